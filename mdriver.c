@@ -29,6 +29,8 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define BATCH_MAX     64 /* most requests -b hands mm at once */
+#define LAT_RUNS      10 /* times -L runs each trace for its latencies */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
@@ -46,9 +48,10 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, CALLOC} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int nmemb;                        /* calloc asks for nmemb blocks of size */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -57,9 +60,11 @@ typedef struct {
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
+    int callocs;         /* number of calloc requests */
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    char *name;          /* the trace file's name (for -D's and -P's files) */
 } trace_t;
 
 /* 
@@ -81,6 +86,12 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double peak;     /* largest the heap got during the trace (0 for libc) */
+    double heap;     /* heap size once the trace is done (0 for libc) */
+    double sbrks;    /* mem_sbrk calls made during the trace (0 for libc) */
+    double bsecs;    /* secs with runs of mallocs / frees batched (-b only) */
+    double lat[4];   /* p50, p99, p99.9 and max nsecs per op (-L only) */
+    struct mm_stats mmstats; /* mm.stats after the util run (if mm has it) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -100,6 +111,23 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* Dump mm's heap layout every this many ops of the util run (set by -D) */
+static int layout_every = 0;
+
+/* Have mm sample a malloc about every this many bytes (set by -P) */
+static size_t profile_rate = 0;
+
+/* The malloc packages linked in (-m picks them), mm.c's is the default.
+   alt_backend is mm.c again with the other free list engine */
+extern const mm_backend_t mm_backend, alt_backend, implicit_backend, naive_backend;
+static const mm_backend_t *backends[] = {
+    &mm_backend, &alt_backend, &implicit_backend, &naive_backend, NULL
+};
+#define NUM_BACKENDS (sizeof(backends)/sizeof(backends[0]) - 1)
+
+/* The package being run, with whatever it lacks filled in by the any_ ones */
+static mm_backend_t mm;
+
 
 /********************* 
  * Function prototypes 
@@ -124,9 +152,25 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, double *lat);
+static int eval_mm_batch(trace_t *trace, int tracenum, range_t **ranges);
+static void eval_mm_batch_speed(void *ptr);
+static void dump_layout(trace_t *trace, int opnum);
+static int peak_op(trace_t *trace);
+static void dump_profile(trace_t *trace);
+static void trace_file(char *path, trace_t *trace, char *suffix);
+
+/* Stand-ins for the calls a malloc package doesn't have */
+static void *any_calloc(size_t nmemb, size_t size);
+static size_t any_malloc_batch(size_t n, const size_t *sizes, void **ptrs);
+static void any_free_batch(size_t n, void **ptrs);
+static void use_backend(const mm_backend_t *backend);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printbatch(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats);
+static void printstats(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -150,6 +194,11 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int run_batch = 0;   /* If set, also time mm malloc batched (set by -b) */
+    int run_latency = 0; /* If set, also time each mm op on its own (-L) */
+    int run_backend[NUM_BACKENDS] = {0}; /* packages to run (set by -m) */
+    int num_run = 0;     /* how many of them there are */
+    int b, found;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +207,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:m:D:P:hvVgalbL")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,12 +227,48 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+        case 'm': /* Run the malloc package called optarg (or all of them) */
+	    found = 0;
+	    for (b = 0; b < NUM_BACKENDS; b++) {
+		if (!strcmp(optarg, "all") || !strcmp(optarg, backends[b]->name)) {
+		    num_run += !run_backend[b];
+		    run_backend[b] = found = 1;
+		}
+	    }
+	    if (!found) {
+		fprintf(stderr, "No malloc package called %s (try:", optarg);
+		for (b = 0; b < NUM_BACKENDS; b++)
+		    fprintf(stderr, " %s", backends[b]->name);
+		fprintf(stderr, " or all)\n");
+		exit(1);
+	    }
+	    break;
+        case 'D': /* Dump mm's heap layout every optarg ops of each trace */
+            layout_every = atoi(optarg);
+            if (layout_every <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'P': /* Profile mm's heap, sampling about every optarg bytes */
+            profile_rate = strtoul(optarg, NULL, 0);
+            if (profile_rate == 0) {
+                usage();
+                exit(1);
+            }
+            break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'b': /* Time mm malloc with batched requests too */
+            run_batch = 1;
+            break;
+        case 'L': /* Time every mm op on its own and report latencies */
+            run_latency = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -274,92 +359,147 @@ int main(int argc, char **argv)
     }
 
     /*
-     * Always run and evaluate the student's mm package
+     * Always run and evaluate the student's mm package (or the packages
+     * picked with -m, one after the other)
      */
-    if (verbose > 1)
-	printf("\nTesting mm malloc\n");
+    if (num_run == 0) {
+	run_backend[0] = 1;
+	num_run = 1;
+    }
 
-    /* Allocate the mm stats array, with one stats_t struct per tracefile */
-    mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
-	unix_error("mm_stats calloc in main failed");
-    
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+    for (b = 0; b < NUM_BACKENDS; b++) {
+	if (!run_backend[b])
+	    continue;
+	use_backend(backends[b]);
+	errors = 0;
+	if (num_run > 1)
+	    printf("\n==== %s ====\n", mm.name);
+
 	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
+	    printf("\nTesting mm malloc\n");
+	if (layout_every && mm.dump_layout == NULL)
+	    printf("(%s can't dump its heap layout, -D skips it)\n", mm.name);
+	if (profile_rate && mm.profile == NULL)
+	    printf("(%s can't profile its heap, -P skips it)\n", mm.name);
+	else if (profile_rate)
+	    mm.profile(profile_rate); /* for the util run and the timed ones */
+
+	/* Allocate the mm stats array, with one stats_t struct per tracefile */
+	mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (mm_stats == NULL)
+	    unix_error("mm_stats calloc in main failed");
+    
+	/* Evaluate student's mm malloc package using the K-best scheme */
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    mm_stats[i].ops = trace->num_ops;
 	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+		printf("Checking mm_malloc for correctness, ");
+	    mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	    if (mm_stats[i].valid) {
+		if (verbose > 1)
+		    printf("efficiency, ");
+		mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+		mm_stats[i].peak = mem_peak_heapsize();
+		mm_stats[i].heap = mem_heapsize();
+		mm_stats[i].sbrks = mem_sbrk_calls();
+		if (mm.stats != NULL)
+		    mm.stats(&mm_stats[i].mmstats);
+		speed_params.trace = trace;
+		speed_params.ranges = ranges;
+		if (verbose > 1)
+		    printf("and performance.\n");
+		mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    }
+	    if (mm_stats[i].valid && run_batch) {
+		if (verbose > 1)
+		    printf("Checking batched mm_malloc for correctness and performance.\n");
+		mm_stats[i].valid = eval_mm_batch(trace, i, &ranges);
+		if (mm_stats[i].valid)
+		    mm_stats[i].bsecs = fsecs(eval_mm_batch_speed, &speed_params);
+	    }
+	    if (mm_stats[i].valid && run_latency) {
+		if (verbose > 1)
+		    printf("Timing each mm op on its own.\n");
+		eval_mm_latency(trace, mm_stats[i].lat);
+	    }
+	    free_trace(trace);
 	}
-	free_trace(trace);
-    }
 
-    /* Display the mm results in a compact table */
-    if (verbose) {
-	printf("\nResults for mm malloc:\n");
-	printresults(num_tracefiles, mm_stats);
-	printf("\n");
-    }
-
-    /* 
-     * Accumulate the aggregate statistics for the student's mm package 
-     */
-    secs = 0;
-    ops = 0;
-    util = 0;
-    numcorrect = 0;
-    for (i=0; i < num_tracefiles; i++) {
-	secs += mm_stats[i].secs;
-	ops += mm_stats[i].ops;
-	util += mm_stats[i].util;
-	if (mm_stats[i].valid)
-	    numcorrect++;
-    }
-    avg_mm_util = util/num_tracefiles;
-
-    /* 
-     * Compute and print the performance index 
-     */
-    if (errors == 0) {
-	avg_mm_throughput = ops/secs;
+	/* Display the mm results in a compact table */
+	if (verbose) {
+	    printf("\nResults for mm malloc:\n");
+	    printresults(num_tracefiles, mm_stats);
+	    printf("\n");
+	    if (mm.stats != NULL) {
+		printf("What mm malloc did on each trace (mm_stats):\n");
+		printstats(num_tracefiles, mm_stats);
+		printf("\n");
+	    }
+	}
+	if (run_batch) {
+	    printf("\nResults for mm malloc, one op at a time vs batched:\n");
+	    printbatch(num_tracefiles, mm_stats);
+	    printf("\n");
+	}
+	if (run_latency) {
+	    printf("\nLatency of mm malloc ops in nsecs (%d runs per trace):\n",
+		   LAT_RUNS);
+	    printlatency(num_tracefiles, mm_stats);
+	    printf("\n");
+	}
 
-	p1 = UTIL_WEIGHT * avg_mm_util;
-	if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
-	    p2 = (double)(1.0 - UTIL_WEIGHT);
-	} 
-	else {
-	    p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
-		(avg_mm_throughput/AVG_LIBC_THRUPUT);
+	/* 
+	 * Accumulate the aggregate statistics for the student's mm package 
+	 */
+	secs = 0;
+	ops = 0;
+	util = 0;
+	numcorrect = 0;
+	for (i=0; i < num_tracefiles; i++) {
+	    secs += mm_stats[i].secs;
+	    ops += mm_stats[i].ops;
+	    util += mm_stats[i].util;
+	    if (mm_stats[i].valid)
+		numcorrect++;
 	}
+	avg_mm_util = util/num_tracefiles;
+
+	/* 
+	 * Compute and print the performance index 
+	 */
+	if (errors == 0) {
+	    avg_mm_throughput = ops/secs;
+
+	    p1 = UTIL_WEIGHT * avg_mm_util;
+	    if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
+		p2 = (double)(1.0 - UTIL_WEIGHT);
+	    } 
+	    else {
+		p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
+		    (avg_mm_throughput/AVG_LIBC_THRUPUT);
+	    }
 	
-	perfindex = (p1 + p2)*100.0;
-	printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
-	       p1*100, 
-	       p2*100, 
-	       perfindex);
+	    perfindex = (p1 + p2)*100.0;
+	    printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
+		   p1*100, 
+		   p2*100, 
+		   perfindex);
 	
-    }
-    else { /* There were errors */
-	perfindex = 0.0;
-	printf("Terminated with %d errors\n", errors);
-    }
+	}
+	else { /* There were errors */
+	    perfindex = 0.0;
+	    printf("Terminated with %d errors\n", errors);
+	}
 
-    if (autograder) {
-	printf("correct:%d\n", numcorrect);
-	printf("perfidx:%.0f\n", perfindex);
+	if (autograder) {
+	    printf("correct:%d\n", numcorrect);
+	    printf("perfidx:%.0f\n", perfindex);
+	}
+	free(mm_stats);
     }
 
     exit(0);
@@ -477,7 +617,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, nmemb;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -499,6 +639,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
     fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    trace->name = filename;
     
     /* We'll store each request line in the trace in this array */
     if ((trace->ops = 
@@ -518,6 +659,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    trace->callocs = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
 	switch(type[0]) {
 	case 'a':
@@ -534,6 +676,15 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %u %u", &index, &nmemb, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].nmemb = nmemb;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    trace->callocs++;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -571,6 +722,20 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * reset_heap - Empty the simulated heap before running a trace. Traces
+ *   that calloc start on zero pages, like a new process would, so an
+ *   allocator that knows fresh memory is zero gets credit for it. The
+ *   rest keep their pages and don't pay the page faults.
+ */
+static void reset_heap(trace_t *trace)
+{
+    if (trace->callocs > 0)
+	mem_reset_pages();
+    else
+	mem_reset_brk();
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -585,11 +750,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *p;
     
     /* Reset the heap and free any records in the range list */
-    mem_reset_brk();
+    reset_heap(trace);
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
-    if (mm_init() < 0) {
+    if (mm.init() < 0) {
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
@@ -604,7 +769,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         case ALLOC: /* mm_malloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    if ((p = mm.malloc(size)) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
@@ -629,11 +794,34 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case CALLOC: /* mm_calloc */
+
+	    if ((p = mm.calloc(trace->ops[i].nmemb, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_calloc failed.");
+		return 0;
+	    }
+	    size *= trace->ops[i].nmemb;
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+
+	    /* The block has to come back zeroed, wherever it came from */
+	    for (j = 0; j < size; j++) {
+		if (p[j] != 0) {
+		    malloc_error(tracenum, i, "mm_calloc did not zero the block");
+		    return 0;
+		}
+	    }
+	    memset(p, index & 0xFF, size);
+
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+	    if ((newp = mm.realloc(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
@@ -653,7 +841,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((newp[j] & 0xFF) != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -671,7 +859,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    mm.free(p);
 	    break;
 
 	default:
@@ -690,9 +878,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
  *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   package on the trace. Since mem_sbrk() lets the students give
+ *   memory back, heapsize is the high water mark of brk rather than
+ *   wherever brk ended up.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -702,22 +890,30 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    int profile_at = -1;
     char *p;
     char *newp, *oldp;
 
+    /* -P dumps the profile once the most bytes are live (by the end of a
+       trace they've usually all been freed) */
+    if (profile_rate && mm.profile_dump != NULL)
+	profile_at = peak_op(trace);
+
     /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
-    if (mm_init() < 0)
+    reset_heap(trace);
+    if (mm.init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
     for (i = 0;  i < trace->num_ops;  i++) {
+	if (layout_every && i % layout_every == 0)
+	    dump_layout(trace, i);
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = mm.malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -733,13 +929,28 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 		total_size : max_total_size;
 	    break;
 
+        case CALLOC: /* mm_calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if ((p = mm.calloc(trace->ops[i].nmemb, size)) == NULL) 
+		app_error("mm_calloc failed in eval_mm_util");
+	    size *= trace->ops[i].nmemb;
+
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    if ((newp = mm.realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
 	    /* Remember region and size */
@@ -760,7 +971,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    mm.free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -772,57 +983,295 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+	if (i == profile_at)
+	    dump_profile(trace);
+    }
+    if (layout_every)
+	dump_layout(trace, trace->num_ops);
+
+    return ((double)max_total_size / (double)mem_peak_heapsize());
+}
+
+/*
+ * dump_layout - Write mm's heap layout (after opnum ops of the trace) to
+ *     <trace>-<package>-<opnum>.csv in the current directory
+ */
+static void dump_layout(trace_t *trace, int opnum)
+{
+    char path[MAXLINE], suffix[32];
+    FILE *fp;
+
+    if (mm.dump_layout == NULL)
+	return;
+    snprintf(suffix, sizeof(suffix), "-%07d.csv", opnum);
+    trace_file(path, trace, suffix);
+    if ((fp = fopen(path, "w")) == NULL)
+	unix_error(path);
+    mm.dump_layout(fileno(fp));
+    fclose(fp);
+}
+
+/*
+ * peak_op - The op of the trace after which the most payload bytes are
+ *     live (the first one, if it gets there more than once)
+ */
+static int peak_op(trace_t *trace)
+{
+    int i, index, peak = 0;
+    long total_size = 0, max_total_size = -1;
+    long *sizes;
+
+    if ((sizes = calloc(trace->num_ids, sizeof(long))) == NULL)
+	unix_error("calloc failed in peak_op");
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	case REALLOC:
+	    total_size += trace->ops[i].size - sizes[index];
+	    sizes[index] = trace->ops[i].size;
+	    break;
+	case CALLOC:
+	    sizes[index] = (long)trace->ops[i].size * trace->ops[i].nmemb;
+	    total_size += sizes[index];
+	    break;
+	case FREE:
+	    total_size -= sizes[index];
+	    sizes[index] = 0;
+	    break;
+	}
+	if (total_size > max_total_size) {
+	    max_total_size = total_size;
+	    peak = i;
+	}
     }
+    free(sizes);
+    return peak;
+}
+
+/*
+ * dump_profile - Write mm's heap profile to <trace>-<package>.prof in the
+ *     current directory
+ */
+static void dump_profile(trace_t *trace)
+{
+    char path[MAXLINE];
+    FILE *fp;
+
+    trace_file(path, trace, ".prof");
+    if ((fp = fopen(path, "w")) == NULL)
+	unix_error(path);
+    mm.profile_dump(fileno(fp));
+    fclose(fp);
+}
 
-    return ((double)max_total_size / (double)mem_heapsize());
+/*
+ * trace_file - Name a file <trace>-<package><suffix> (the trace's name
+ *     without its directory or extension) for what mm writes about a trace
+ */
+static void trace_file(char *path, trace_t *trace, char *suffix)
+{
+    char *base, *dot;
+
+    base = strrchr(trace->name, '/');
+    base = (base == NULL) ? trace->name : base + 1;
+    dot = strrchr(base, '.');
+    snprintf(path, MAXLINE, "%.*s-%s%s",
+	     (dot == NULL) ? (int)strlen(base) : (int)(dot - base), base,
+	     mm.name, suffix);
 }
 
 
+/*
+ * eval_mm_op - Run request i of the trace (the heap is assumed valid)
+ */
+static inline void eval_mm_op(trace_t *trace, int i)
+{
+    int index, size, newsize;
+    char *p, *newp, *oldp, *block;
+
+    switch (trace->ops[i].type) {
+
+    case ALLOC: /* mm_malloc */
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	if ((p = mm.malloc(size)) == NULL)
+	    app_error("mm_malloc error in eval_mm_speed");
+	trace->blocks[index] = p;
+	break;
+
+    case CALLOC: /* mm_calloc */
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	if ((p = mm.calloc(trace->ops[i].nmemb, size)) == NULL)
+	    app_error("mm_calloc error in eval_mm_speed");
+	trace->blocks[index] = p;
+	break;
+
+    case REALLOC: /* mm_realloc */
+	index = trace->ops[i].index;
+	newsize = trace->ops[i].size;
+	oldp = trace->blocks[index];
+	if ((newp = mm.realloc(oldp,newsize)) == NULL)
+	    app_error("mm_realloc error in eval_mm_speed");
+	trace->blocks[index] = newp;
+	break;
+
+    case FREE: /* mm_free */
+	index = trace->ops[i].index;
+	block = trace->blocks[index];
+	mm.free(block);
+	break;
+
+    default:
+	app_error("Nonexistent request type in eval_mm_valid");
+    }
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
+    int i;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0) 
+    reset_heap(trace);
+    if (mm.init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
     for (i = 0;  i < trace->num_ops;  i++)
+	eval_mm_op(trace, i);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_mm_latency - Run the trace LAT_RUNS times timing every request
+ *    on its own, and fill in lat with the 50th, 99th and 99.9th
+ *    percentile and the largest of those times (in nsecs). Each time
+ *    includes a clock_gettime call, which is the same for everyone.
+ */
+static void eval_mm_latency(trace_t *trace, double *lat)
+{
+    int i, run, n = 0;
+    struct timespec start, end;
+    double *times = malloc(LAT_RUNS * trace->num_ops * sizeof(double));
+
+    if (times == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+    for (run = 0; run < LAT_RUNS; run++) {
+	reset_heap(trace);
+	if (mm.init() < 0) 
+	    app_error("mm_init failed in eval_mm_latency");
+	for (i = 0;  i < trace->num_ops;  i++) {
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    eval_mm_op(trace, i);
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    times[n++] = (end.tv_sec - start.tv_sec)*1e9 +
+		(end.tv_nsec - start.tv_nsec);
+	}
+    }
+    qsort(times, n, sizeof(double), compare_doubles);
+    lat[0] = times[n/2];
+    lat[1] = times[(int)(n*0.99)];
+    lat[2] = times[(int)(n*0.999)];
+    lat[3] = times[n-1];
+    free(times);
+}
+
+/*
+ * eval_mm_batch - Run the trace with each run of up to BATCH_MAX mallocs
+ *    or frees handed to mm_malloc_batch / mm_free_batch in one call
+ *    (reallocs and callocs still go one at a time). With ranges it checks
+ *    the blocks like eval_mm_valid does, without it just runs for fcyc.
+ */
+static int eval_mm_batch(trace_t *trace, int tracenum, range_t **ranges)
+{
+    int i, j, n, index;
+    size_t sizes[BATCH_MAX];
+    void *ptrs[BATCH_MAX];
+    char *p;
+
+    reset_heap(trace);
+    if (ranges != NULL)
+	clear_ranges(ranges);
+    if (mm.init() < 0) 
+	app_error("mm_init failed in eval_mm_batch");
+
+    for (i = 0;  i < trace->num_ops;  i += n) {
+	/* Gather the run of requests like this one */
+	for (n = 0; n < BATCH_MAX && i + n < trace->num_ops &&
+		 trace->ops[i + n].type == trace->ops[i].type; n++) {
+	    sizes[n] = trace->ops[i + n].size;
+	    ptrs[n] = trace->blocks[trace->ops[i + n].index];
+	}
+
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+        case ALLOC: /* mm_malloc_batch */
+	    if (mm.malloc_batch(n, sizes, ptrs) != n) {
+		if (ranges == NULL)
+		    app_error("mm_malloc_batch error in eval_mm_batch");
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = 0; j < n; j++) {
+		if (ranges != NULL && 
+		    add_range(ranges, ptrs[j], sizes[j], tracenum, i + j) == 0)
+		    return 0;
+		trace->blocks[trace->ops[i + j].index] = ptrs[j];
+	    }
+	    break;
 
-	case REALLOC: /* mm_realloc */
+        case FREE: /* mm_free_batch */
+	    if (ranges != NULL)
+		for (j = 0; j < n; j++)
+		    remove_range(ranges, ptrs[j]);
+	    mm.free_batch(n, ptrs);
+	    break;
+
+	default: /* mm_realloc / mm_calloc, one at a time */
+	    n = 1;
 	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
-            break;
+	    if (trace->ops[i].type == REALLOC)
+		p = mm.realloc(trace->blocks[index], sizes[0]);
+	    else
+		p = mm.calloc(trace->ops[i].nmemb, sizes[0]);
+	    if (p == NULL) {
+		if (ranges == NULL)
+		    app_error("mm_realloc / mm_calloc error in eval_mm_batch");
+		malloc_error(tracenum, i, "mm_realloc / mm_calloc failed.");
+		return 0;
+	    }
+	    if (ranges != NULL) {
+		if (trace->ops[i].type == REALLOC)
+		    remove_range(ranges, trace->blocks[index]);
+		else
+		    sizes[0] *= trace->ops[i].nmemb;
+		if (add_range(ranges, p, sizes[0], tracenum, i) == 0)
+		    return 0;
+	    }
+	    trace->blocks[index] = p;
+        }
+    }
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            block = trace->blocks[index];
-            mm_free(block);
-            break;
+    return 1;
+}
 
-	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
-        }
+/*
+ * eval_mm_batch_speed - The batched run, timed by fcyc()
+ */
+static void eval_mm_batch_speed(void *ptr)
+{
+    eval_mm_batch(((speed_t *)ptr)->trace, 0, NULL);
 }
 
 /*
@@ -847,6 +1296,14 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case CALLOC: /* calloc */
+	    if ((p = calloc(trace->ops[i].nmemb, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -891,6 +1348,14 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+        case CALLOC: /* calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = calloc(trace->ops[i].nmemb, size)) == NULL)
+		unix_error("calloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -915,6 +1380,138 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * printbatch - prints the mm malloc throughput one op at a time next to
+ *     the throughput with batched requests (-b)
+ */
+static void printbatch(int n, stats_t *stats)
+{
+    int i;
+    double secs = 0;
+    double bsecs = 0;
+    double ops = 0;
+
+    printf("%5s%7s%8s%10s%6s%10s%6s\n", 
+	   "trace", " valid", "ops", "secs", "Kops", "bsecs", "bKops");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%2d%10s%8.0f%10.6f%6.0f%10.6f%6.0f\n", 
+		   i,
+		   "yes",
+		   stats[i].ops,
+		   stats[i].secs,
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].bsecs,
+		   (stats[i].ops/1e3)/stats[i].bsecs);
+	    secs += stats[i].secs;
+	    bsecs += stats[i].bsecs;
+	    ops += stats[i].ops;
+	}
+	else {
+	    printf("%2d%10s%8s%10s%6s%10s%6s\n", 
+		   i, "no", "-", "-", "-", "-", "-");
+	}
+    }
+    if (errors == 0) {
+	printf("%12s%8.0f%10.6f%6.0f%10.6f%6.0f\n", 
+	       "Total       ",
+	       ops, 
+	       secs,
+	       (ops/1e3)/secs,
+	       bsecs,
+	       (ops/1e3)/bsecs);
+    }
+}
+
+/*
+ * printlatency - prints the percentiles of the mm malloc op times (-L),
+ *     and the worst of each over all the traces
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    int i, j;
+    double worst[4] = {0, 0, 0, 0};
+
+    printf("%5s%7s%8s%8s%8s%8s%8s\n", 
+	   "trace", " valid", "ops", "p50", "p99", "p99.9", "max");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%2d%10s%8.0f%8.0f%8.0f%8.0f%8.0f\n", 
+		   i,
+		   "yes",
+		   stats[i].ops,
+		   stats[i].lat[0],
+		   stats[i].lat[1],
+		   stats[i].lat[2],
+		   stats[i].lat[3]);
+	    for (j = 0; j < 4; j++)
+		if (stats[i].lat[j] > worst[j])
+		    worst[j] = stats[i].lat[j];
+	}
+	else {
+	    printf("%2d%10s%8s%8s%8s%8s%8s\n", 
+		   i, "no", "-", "-", "-", "-", "-");
+	}
+    }
+    if (errors == 0) {
+	printf("%12s%8s%8.0f%8.0f%8.0f%8.0f\n", 
+	       "Worst       ",
+	       "", 
+	       worst[0],
+	       worst[1],
+	       worst[2],
+	       worst[3]);
+    }
+}
+
+/*
+ * printstats - prints the mm_stats counts of each trace's util run, and
+ *     the free space (by block size) it left behind
+ */
+static void printstats(int n, stats_t *stats)
+{
+    int i, j;
+    struct mm_stats *s;
+
+    printf("%5s%8s%7s%7s%25s%30s%7s\n",
+	   "trace", "liveKB", "sbrks", "splits", "coalesce none/nxt/prv/2",
+	   "realloc fit/nxt/ext/dwn/mov", "nodes");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid) {
+	    printf("%2d%11s\n", i, "-");
+	    continue;
+	}
+	s = &stats[i].mmstats;
+	printf("%2d%11.0f%7lu%7lu %6lu%6lu%6lu%6lu %6lu%6lu%6lu%6lu%6lu%7lu\n",
+	       i,
+	       (double)(long)s->counts.live_bytes/1024,
+	       (unsigned long)s->counts.sbrks,
+	       (unsigned long)s->counts.splits,
+	       (unsigned long)s->counts.coalesce[0],
+	       (unsigned long)s->counts.coalesce[1],
+	       (unsigned long)s->counts.coalesce[2],
+	       (unsigned long)s->counts.coalesce[3],
+	       (unsigned long)s->counts.realloc_in_place,
+	       (unsigned long)s->counts.realloc_next,
+	       (unsigned long)s->counts.realloc_extend,
+	       (unsigned long)s->counts.realloc_down,
+	       (unsigned long)s->counts.realloc_move,
+	       (unsigned long)s->free_nodes);
+    }
+    printf("\nFree KB left at the end, by block size (2^n bytes):\n");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	s = &stats[i].mmstats;
+	printf("%2d %7.0fKB heap, %lu free blocks:", i,
+	       (double)s->heap_bytes/1024, (unsigned long)s->free_blocks);
+	for (j = 0; j < MM_STATS_BINS; j++)
+	    if (s->free_bytes[j] > 0)
+		printf(" 2^%d:%.1f", j, (double)s->free_bytes[j]/1024);
+	printf("\n");
+    }
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -924,54 +1521,129 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double peak = 0;
+    double heap = 0;
+    double sbrks = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%8s%8s%7s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "peakKB", "endKB",
+	   "sbrks");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (stats[i].peak > 0)
+		printf("%8.0f%8.0f%7.0f\n", stats[i].peak/1024,
+		       stats[i].heap/1024, stats[i].sbrks);
+	    else
+		printf("%8s%8s%7s\n", "-", "-", "-");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    peak += stats[i].peak;
+	    heap += stats[i].heap;
+	    sbrks += stats[i].sbrks;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s%8s%8s%7s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%8.0f%10.6f%6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
+	if (peak > 0)
+	    printf("%8.0f%8.0f%7.0f\n", peak/1024, heap/1024, sbrks);
+	else
+	    printf("%8s%8s%7s\n", "-", "-", "-");
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%8s%10s%6s%8s%8s%7s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
+	       "-",
+	       "-",
+	       "-",
 	       "-");
     }
 
 }
 
+/*
+ * use_backend - Make backend the malloc package that mm runs, standing in
+ *     for the calls it doesn't have
+ */
+static void use_backend(const mm_backend_t *backend)
+{
+    mm = *backend;
+    if (mm.calloc == NULL)
+	mm.calloc = any_calloc;
+    if (mm.malloc_batch == NULL)
+	mm.malloc_batch = any_malloc_batch;
+    if (mm.free_batch == NULL)
+	mm.free_batch = any_free_batch;
+}
+
+/*
+ * any_calloc - calloc for a package without one: malloc and zero it
+ */
+static void *any_calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size != 0 && nmemb > ((size_t)-1) / size)
+	return NULL;
+    if ((p = mm.malloc(nmemb * size)) != NULL)
+	memset(p, 0, nmemb * size);
+    return p;
+}
+
+/*
+ * any_malloc_batch - malloc_batch for a package without one, one at a time
+ */
+static size_t any_malloc_batch(size_t n, const size_t *sizes, void **ptrs)
+{
+    size_t i, got = 0;
+
+    for (i = 0; i < n; i++)
+	if ((ptrs[i] = mm.malloc(sizes[i])) != NULL)
+	    got++;
+    return got;
+}
+
+/*
+ * any_free_batch - free_batch for a package without one, one at a time
+ */
+static void any_free_batch(size_t n, void **ptrs)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	mm.free(ptrs[i]);
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1004,13 +1676,19 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValbL] [-f <file>] [-t <dir>] [-m <name>] [-D <n>] [-P <rate>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-b         Time mm malloc with batched requests too.\n");
+    fprintf(stderr, "\t-D <n>     Write mm's heap layout every <n> ops to <trace>-<name>-<op>.csv.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report the latency of each mm malloc op too.\n");
+    fprintf(stderr, "\t-m <name>  Run malloc package <name> (trie, tlsf, implicit, naive or all).\n");
+    fprintf(stderr, "\t-P <rate>  Profile mm's heap (one sample per <rate> bytes), write it at each\n");
+    fprintf(stderr, "\t           trace's peak to <trace>-<name>.prof. Timed runs are sampled too.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
@@ -3,6 +3,10 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+/* for mremap */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -18,20 +22,30 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_peak_brk;   /* highest mem_brk since the last reset */
+static char *mem_fresh_brk;  /* nothing at or above this has been handed out */
+static size_t mem_sbrks;     /* mem_sbrk calls since the last reset */
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* map the storage we will use to model the available VM 
+       (zeroed, like the pages a real sbrk hands out, and page aligned
+       so that mem_remap can move its pages around) */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak_brk = mem_start_brk;
+    mem_fresh_brk = mem_start_brk;
+    mem_sbrks = 0;
 }
 
 /* 
@@ -39,7 +53,7 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
@@ -48,26 +62,101 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_peak_brk = mem_start_brk;
+    mem_sbrks = 0;
+}
+
+/*
+ * mem_reset_pages - mem_reset_brk, and also hand every page the heap has
+ *    used back to the OS, so the next heap starts out on zero pages like
+ *    it would in a new process
+ */
+void mem_reset_pages()
+{
+    size_t page = mem_pagesize();
+    char *lo = (char *)(((size_t)mem_start_brk + page - 1) & ~(page - 1));
+
+    if (lo < mem_fresh_brk) {
+	memset(mem_start_brk, 0, lo - mem_start_brk);
+	madvise(lo, mem_fresh_brk - lo, MADV_DONTNEED);
+    }
+    mem_fresh_brk = mem_start_brk;
+    mem_reset_brk();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. 
+ *    A negative incr shrinks the heap, and any whole pages that 
+ *    drop out of it are handed back to the OS like a real sbrk would.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    mem_sbrks++;
+    if (incr < 0) {
+	size_t page = mem_pagesize();
+	char *lo, *hi;
+
+	if (mem_brk + incr < mem_start_brk) {
+	    errno = EINVAL;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap start...\n");
+	    return (void *)-1;
+	}
+	mem_brk += incr;
+	lo = (char *)(((size_t)mem_brk + page - 1) & ~(page - 1));
+	hi = (char *)((size_t)old_brk & ~(page - 1));
+	if (lo < hi)
+	    madvise(lo, hi - lo, MADV_DONTNEED);
+	return (void *)old_brk;
+    }
+    if ((mem_brk + incr) > mem_max_addr) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_peak_brk)
+	mem_peak_brk = mem_brk;
+    if (mem_brk > mem_fresh_brk)
+	mem_fresh_brk = mem_brk;
     return (void *)old_brk;
 }
 
+/*
+ * mem_remap - move the len bytes of whole pages at src to dst (both page
+ *    aligned, not overlapping, and in anonymous memory like the heap)
+ *    without copying them: the kernel just moves the pages. src is left
+ *    holding fresh zero pages. Returns 0, or -1 if the pages couldn't be
+ *    moved and the caller has to copy them after all
+ */
+int mem_remap(void *dst, void *src, size_t len)
+{
+#ifdef MREMAP_FIXED
+    char *fresh;
+
+    if (len == 0)
+	return 0;
+    /* get src's replacement first, so a failure can't leave a hole */
+    fresh = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED)
+	return -1;
+    if (mremap(src, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED) {
+	munmap(fresh, len);
+	return -1;
+    }
+    if (mremap(fresh, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, src) == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_remap failed. Left a hole in the heap...\n");
+	exit(1);
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -84,6 +173,15 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_fresh_lo - return the lowest address that has never been part of
+ *    the heap. Everything from there on still reads as zero.
+ */
+void *mem_fresh_lo()
+{
+    return (void *)mem_fresh_brk;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -92,6 +190,24 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest the heap has been (in bytes)
+ *    since the last mem_init or mem_reset_brk
+ */
+size_t mem_peak_heapsize() 
+{
+    return (size_t)(mem_peak_brk - mem_start_brk);
+}
+
+/*
+ * mem_sbrk_calls() - returns how many times mem_sbrk has been called
+ *    (to grow or shrink the heap) since the last mem_init or mem_reset_brk
+ */
+size_t mem_sbrk_calls() 
+{
+    return mem_sbrks;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -4,8 +4,13 @@ void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
+void mem_reset_pages(void);
+int mem_remap(void *dst, void *src, size_t len);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_fresh_lo(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
+size_t mem_sbrk_calls(void);
 size_t mem_pagesize(void);
 
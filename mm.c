@@ -21,13 +21,58 @@
  */
 // best = 87%
 
+// for mremap
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#if THREAD_SAFE
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+#if PROFILE
+#  include <math.h>
+#  include <execinfo.h>
+#endif
 
+#ifdef MM_BACKEND
+/* built into mdriver a second time (as mm-alt.o) with the other free list
+   engine, so -m can run the trie and TLSF side by side: only alt_backend
+   (at the bottom of the public calls) is ours to export, the mm_ names and
+   team belong to mm.o */
+#  if defined(TLSF) && TLSF
+#    undef TLSF
+#    define TLSF (0)
+#  else
+#    undef TLSF
+#    define TLSF (1)
+#  endif
+#  define mm_init alt_init
+#  define mm_malloc alt_malloc
+#  define mm_free alt_free
+#  define mm_free_sized alt_free_sized
+#  define mm_realloc alt_realloc
+#  define mm_calloc alt_calloc
+#  define mm_memalign alt_memalign
+#  define mm_posix_memalign alt_posix_memalign
+#  define mm_malloc_batch alt_malloc_batch
+#  define mm_free_batch alt_free_batch
+#  define mm_trim alt_trim
+#  define mm_stats alt_stats
+#  define mm_profile alt_profile
+#  define mm_profile_dump alt_profile_dump
+#  define mm_dump_layout alt_dump_layout
+#  define mm_backend alt_backend
+#  define team alt_team
+#endif
 #include "mm.h"
 #include "memlib.h"
 
@@ -44,14 +89,66 @@ team_t team = {
     ""
 };
 
-// The following 3 defines are the only setable constants in my code:
+// The following defines are the only setable constants in my code:
+// (the ones wrapped in #ifndef can also be set from the Makefile via MMFLAGS)
 
 //  Turn debugging code on
 //     0 -> no debugging checks or output
 //     1 -> low level checks
 //     2 -> verbose output
 //  All debug output is sent to stderr
+#ifndef DEBUG
 #define DEBUG (0)
+#endif
+
+//  Thread safety
+//     0 -> single threaded, no locking at all
+//     1 -> one heap lock, fronted by a small per-thread cache of free blocks
+#ifndef THREAD_SAFE
+#define THREAD_SAFE (0)
+#endif
+
+//  Free node links
+//     0 -> the trie / stack links in a free block are plain pointers
+//     1 -> they are 32 bit byte offsets from heap, which halves MIN_SIZE
+//          (every heap, arenas included, must fit in 4GB)
+#ifndef COMPACT_NODES
+#define COMPACT_NODES (0)
+#endif
+
+//  Small object slabs
+//     0 -> every block goes through the trie
+//     1 -> requests up to SLAB_MAX_SIZE are carved out of page sized runs
+//          of equal slots that have no headers / footers of their own
+#ifndef SLAB
+#define SLAB (1)
+#endif
+
+// largest request (in bytes) that is served from a slab (at most 512)
+// NOTE: above 64 the half empty runs of each class cost more than the
+//       boundary tags we save on them (in testing)
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE (64)
+#endif
+// bytes in one run of slots (must be a power of two)
+#define SLAB_RUN_SIZE (4096)
+// runs are only made in the first this-many bytes of the heap
+#define SLAB_SPAN ((size_t)1 << 32)
+
+// largest block size (in bytes) that a thread cache will hold on to
+#define TCACHE_MAX_SIZE (512)
+// how many blocks of each size a thread cache holds before spilling half
+#define TCACHE_COUNT (16)
+
+// number of arenas (independent heaps with their own lock) in the thread
+// safe build. arena 0 is memlib's heap, the others share one mmap'd region
+// in which each gets ARENA_SPAN bytes of address space
+#ifndef ARENA_COUNT
+#define ARENA_COUNT (8)
+#endif
+#ifndef ARENA_SPAN
+#define ARENA_SPAN ((size_t)1 << 30)
+#endif
 
 /* byte alignment (must be power of two and evenly divide DSIZE) */
 #define ALIGNMENT 8
@@ -59,6 +156,120 @@ team_t team = {
 // the largest size a block is allowed to be (must be aligned)
 #define MAX_SIZE ((size_t)((1<<28)-ALIGNMENT))
 
+// requests of at least this many bytes (and all above MAX_SIZE) get their
+// own mmap instead of a block in the heap
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD ((size_t)1 << 22)
+#endif
+
+// a heap block of at least REMAP_THRESHOLD bytes that realloc has to move
+// gets its whole pages remapped into the new block instead of copied (below
+// that, the syscalls and refaults cost more than the memcpy)
+#ifndef REMAP_THRESHOLD
+#define REMAP_THRESHOLD ((size_t)1 << 21)
+#endif
+
+// when a free makes the last block at least TRIM_THRESHOLD bytes, and the top
+// of the heap has been that free for TRIM_DELAY milliseconds, it is handed
+// back to memlib, leaving TRIM_PAD bytes for next time (0 trims right away)
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD ((size_t)1 << 17)
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD TRIM_THRESHOLD
+#endif
+#ifndef TRIM_DELAY
+#define TRIM_DELAY (1000)
+#endif
+
+// with PURGE on, free blocks of at least PURGE_THRESHOLD bytes give the pages
+// inside them back to the OS (they stay part of the heap, they just stop
+// costing RSS)
+#ifndef PURGE
+#define PURGE (0)
+#endif
+#ifndef PURGE_THRESHOLD
+#define PURGE_THRESHOLD ((size_t)1 << 18)
+#endif
+
+// how many free blocks an aligned allocation looks at for one that happens
+// to line up before it settles for one big enough to line up anywhere
+#define ALIGNED_FIT_TRIES (8)
+
+// a block that realloc grows GROW_STREAK times in a row gets room for half as
+// much again as it asked for, so the next few grows don't move or extend it.
+// GROW_SLOTS (a power of two) is how many such blocks each heap keeps track of
+#ifndef REALLOC_SLACK
+#define REALLOC_SLACK (0)
+#endif
+#define GROW_STREAK (2)
+#define GROW_SLOTS (8)
+
+// with QUICK_LISTS on, freed blocks of up to QUICK_MAX_SIZE bytes aren't
+// coalesced right away. They wait on a stack per block size for a malloc of
+// exactly that size, and only go back to the trie (all of them at once) when
+// a malloc finds nothing in the trie or QUICK_COUNT of them have piled up
+#ifndef QUICK_LISTS
+#define QUICK_LISTS (0)
+#endif
+#ifndef QUICK_MAX_SIZE
+#define QUICK_MAX_SIZE (256)
+#endif
+#ifndef QUICK_COUNT
+#define QUICK_COUNT (64)
+#endif
+
+// with HEAP_CHUNKS on, a malloc that has to grow the heap grows it by an
+// extra chunk (left free at the top) as well. Misses less than CHUNK_WINDOW
+// heap mallocs apart double the chunk, starting from CHUNK_MIN; a miss after a
+// quieter spell, or the heap getting trimmed, halves it. It never gets bigger
+// than CHUNK_MAX or 1/CHUNK_FRACTION of the heap (and a heap too small for
+// CHUNK_MIN doesn't get one)
+#ifndef HEAP_CHUNKS
+#define HEAP_CHUNKS (1)
+#endif
+#define CHUNK_WINDOW (64)
+#define CHUNK_MIN (256)
+#define CHUNK_MAX (4096)
+#define CHUNK_FRACTION (64)
+
+// with TLSF on, free blocks live in two level segregated fit lists instead of
+// the trie: one list per TLSF_SL_BITS-th of each power of two (exact sizes
+// below 2^TLSF_SL_BITS*ALIGNMENT), and a bitmap per level. Every freelist
+// operation is a handful of bit instructions, whatever is in the heap, at the
+// cost of fits that are only good rather than best
+#ifndef TLSF
+#define TLSF (0)
+#endif
+#define TLSF_SL_BITS (4)
+
+// with ADDRESS_ORDER on, the free blocks of one size in the trie (and every
+// TLSF list) are kept lowest address first instead of last freed first, so
+// the blocks that get reused are the ones nearest the bottom of the heap
+#ifndef ADDRESS_ORDER
+#define ADDRESS_ORDER (0)
+#endif
+
+// with STATS on, mm_stats also counts what the allocator has been doing
+// since mm_init (the struct mm_counts in mm.h). In the thread safe build each
+// thread counts into its own shard (STATS_SHARDS of them, taken in turn) and
+// mm_stats adds them up
+#ifndef STATS
+#define STATS (0)
+#endif
+#define STATS_SHARDS (64)
+
+// with PROFILE on, mm_profile(rate) has the public calls record the call
+// stack of about one block per rate bytes they hand out (the gaps between
+// samples are random, exponential with that mean) until it is freed.
+// mm_profile_dump writes the live ones out by call stack. There's room for
+// PROFILE_SAMPLES live samples of PROFILE_DEPTH frames each
+#ifndef PROFILE
+#define PROFILE (0)
+#endif
+#define PROFILE_SAMPLES (4096)
+#define PROFILE_DEPTH (16)
+
 // The rest of the definitions are computed values
 
 /* rounds up to the nearest multiple of ALIGNMENT 
@@ -75,6 +286,32 @@ team_t team = {
 #  define TRUE  (1)
 #  define FALSE (0)
 #endif
+/* link_t / slot_t
+ *
+ * A link_t points at a freenode_t, a slot_t points at a link_t (wherever it
+ * lives: a bin, or a next / child of another node). NIL is the empty link.
+ * With COMPACT_NODES both are byte offsets from heap (which is never a node
+ * itself, so 0 works as NIL); otherwise they're just pointers.
+ * NODE / LINK and SLOT / SLOT_OF convert between the two forms.
+ */
+#if COMPACT_NODES
+typedef unsigned int link_t;
+typedef unsigned int slot_t;
+#  define NIL ((link_t)0)
+#  define NODE(l) ((struct freenode_t *)((char *)heap + (l)))
+#  define LINK(p) ((link_t)((char *)(p) - (char *)heap))
+#  define SLOT(s) ((link_t *)((char *)heap + (s)))
+#  define SLOT_OF(lp) ((slot_t)((char *)(lp) - (char *)heap))
+#else
+typedef struct freenode_t *link_t;
+typedef link_t *slot_t;
+#  define NIL NULL
+#  define NODE(l) (l)
+#  define LINK(p) ((struct freenode_t *)(p))
+#  define SLOT(s) (s)
+#  define SLOT_OF(lp) (lp)
+#endif
+
 /* struct freenode_t
  *
  * This is the structure _inside_ the freespace (doesn't include header/footer)
@@ -82,10 +319,10 @@ team_t team = {
  */
 struct freenode_t 
 {
-  struct freenode_t *next;  // next freenode_t of the same size (stack)
+  link_t next;  // next freenode_t of the same size (stack)
   // NOTE: left and right _must_ be in order and next to eachother
-  struct freenode_t *children[2]; 
-  struct freenode_t **prev; // pointer to the _only_ pointer that points here
+  link_t children[2]; 
+  slot_t prev; // the _only_ link that points here
 };
 #define POINTER_SIZE (sizeof(void *)) /* size of pointers */
 #define WSIZE (sizeof(size_t))
@@ -104,24 +341,267 @@ struct freenode_t
  * and (via &ptr->head[1]) points to first block on the heap
  *
  */
+#if SLAB
+/* struct slab_run_t
+ *
+ * This sits at the (SLAB_RUN_SIZE aligned) start of every run. The run itself
+ * is an ordinary allocated block as far as the heap is concerned.
+ * The slots start right after this header.
+ */
+#define SLAB_MAP_WORDS ((SLAB_RUN_SIZE/ALIGNMENT + BITNESS - 1)/BITNESS)
+struct slab_run_t
+{
+  struct slab_run_t *next;  // next run of this class that has free slots
+  struct slab_run_t **prev; // pointer to the _only_ pointer that points here
+  unsigned int slot_size;
+  unsigned int nslots;
+  unsigned int nfree;
+  unsigned int class;
+  unsigned long freemap[SLAB_MAP_WORDS]; // bit set -> slot is free
+};
+static const unsigned short slab_sizes[] =
+  {8, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512};
+#define SLAB_CLASSES (sizeof(slab_sizes)/sizeof(slab_sizes[0]))
+#define SLAB_FIRST_SLOT (ALIGN(sizeof(struct slab_run_t)))
+#endif
+
+#if TLSF
+// second level lists per first level
+#define SL_COUNT (1 << TLSF_SL_BITS)
+// log2 of the smallest size that isn't in first level 0
+#define FL_SHIFT (TLSF_SL_BITS + __builtin_ctzl(ALIGNMENT))
+// first level 0 for the small sizes, then one per power of two up to MAX_SIZE
+#define FL_COUNT (BITNESS - BIT_OFFSET - FL_SHIFT + 1)
+/* struct tlsf_t
+ *
+ * The TLSF lists: lists[fl][sl] is a stack of free blocks (linked through
+ * next, with prev pointing at whatever points to them like in the trie).
+ * Bit sl of sl_map[fl] is set IFF lists[fl][sl] isn't empty, and bit fl of
+ * fl_map IFF sl_map[fl] isn't 0.
+ */
+struct tlsf_t
+{
+  size_t fl_map;
+  unsigned int sl_map[FL_COUNT];
+  link_t lists[FL_COUNT][SL_COUNT];
+};
+#endif
+
+#if REALLOC_SLACK
+/* struct grow_t
+ *
+ * One block that realloc has been growing: the block size it got last time
+ * (if the header doesn't say that any more it's someone else's block), the
+ * size the caller asked for and how many grows in a row we've seen.
+ */
+struct grow_t
+{
+  void *bp;
+  size_t bsize;
+  size_t size;
+  size_t count;
+};
+#endif
+
 struct heaphead_t
 {
-  struct freenode_t *bins[BIT_COUNT];
+  #if TLSF && COMPACT_NODES
+  struct tlsf_t tlsf[1]; // 32 bit links can only reach it inside the heap
+  #elif TLSF
+  struct tlsf_t *tlsf; // the free lists (outside the heap, like the slab map)
+  #else
+  link_t bins[BIT_COUNT];
+  size_t binmap; // bit n is set IFF bins[n] isn't empty
+  #endif
+  void *last_block; // the block right before the epilogue
+  #if TRIM_DELAY
+  size_t trim_since; // when a free left the top past TRIM_THRESHOLD (0 = not yet)
+  #endif
+  #if HEAP_CHUNKS
+  size_t chunk; // how much extra the last miss grew the heap by
+  size_t since_miss; // heap mallocs since then
+  #endif
+  #if REALLOC_SLACK
+  struct grow_t *grows; // GROW_SLOTS blocks with slack, hashed by address
+  size_t grow_count; // how many of grows are in use
+  #endif
+  #if QUICK_LISTS
+  // QUICK_MAX_SIZE/ALIGNMENT + 1 stacks of freed blocks (still marked
+  // allocated) by block size, linked through their first word
+  void **quick;
+  size_t quick_count; // how many blocks are on them
+  #endif
+  #if SLAB
+  struct slab_run_t *slabs[SLAB_CLASSES]; // runs with free slots, per class
+  // one bit per SLAB_RUN_SIZE of the heap, set if a run starts there
+  unsigned long *slab_map;
+  // first run number covered by the map, how far up we have used it
+  // and how many runs the map has room for
+  size_t slab_map_base, slab_map_top, slab_map_runs;
+  #endif
   size_t prologue[2];
   size_t head[1];
 };
 
-// The global heap pointers
-struct heaphead_t * heap;
-void *last_block;
+#if THREAD_SAFE
+// the heap of the arena this thread is working in (see the Arenas section)
+static __thread struct heaphead_t *heap;
+#else
+// The global heap pointer
+static struct heaphead_t * heap;
+#endif
+
+#if SLAB
+// the slab map of memlib's heap (other arenas keep theirs in their region)
+static unsigned long slab_map[SLAB_SPAN/SLAB_RUN_SIZE/BITNESS];
+// request size (in ALIGNMENT units) -> slab class
+static unsigned char slab_class_for[SLAB_MAX_SIZE/ALIGNMENT + 1];
+#  define SLAB_MAP_INDEX(p) (((size_t)(p))/SLAB_RUN_SIZE - heap->slab_map_base)
+#  define IS_SLAB(p) ((SLAB_MAP_INDEX(p) < heap->slab_map_top) && \
+        ((heap->slab_map[SLAB_MAP_INDEX(p)/BITNESS] >> (SLAB_MAP_INDEX(p)%BITNESS)) & 1))
+#  define SLAB_RUN(p) ((struct slab_run_t *)(((size_t)(p)) & ~((size_t)SLAB_RUN_SIZE-1)))
+#endif
+
+#if TLSF && !COMPACT_NODES
+// the free lists of memlib's heap (other arenas keep theirs in arena_t)
+static struct tlsf_t tlsf;
+#endif
+#if REALLOC_SLACK
+// the grow table of memlib's heap (other arenas keep theirs in arena_t)
+static struct grow_t grows[GROW_SLOTS];
+#endif
+#if QUICK_LISTS
+// the quick lists of memlib's heap (other arenas keep theirs in arena_t)
+static void *quick[QUICK_MAX_SIZE/ALIGNMENT + 1];
+#endif
+
+#if THREAD_SAFE
+/* struct tcache_t
+ *
+ * Each thread keeps one of these. It holds recently freed blocks of the
+ * small sizes as stacks (linked through the first word of the payload).
+ * The blocks stay marked as allocated in the heap so nobody coalesces them.
+ * The generation tells us if mm_init has thrown the heap away under us.
+ */
+#define TCACHE_BINS (1 + TCACHE_MAX_SIZE/ALIGNMENT)
+struct tcache_t
+{
+  unsigned long generation;
+  void *blocks[TCACHE_BINS];
+  unsigned int counts[TCACHE_BINS];
+};
+
+/* struct arena_t
+ *
+ * One independent heap: its own heaphead_t (bins, slabs, last_block) and
+ * its own lock, so threads in different arenas never wait on each other.
+ * Arena 0 grows through mem_sbrk, the rest through heap_sbrk in their
+ * slice of arena_region.
+ */
+struct arena_t
+{
+  pthread_mutex_t lock; // protects everything reachable from heap
+  struct heaphead_t *heap; // NULL until first used after an mm_init
+  char *start, *brk, *end; // our slice of arena_region (unused by arena 0)
+  char *fresh; // highest brk since the slice was last released (still zero above)
+  // blocks freed by threads that don't malloc from here, linked through
+  // their first word. pushed without the lock, taken whole by whoever
+  // locks the arena next
+  void *remote;
+  #if TLSF && !COMPACT_NODES
+  struct tlsf_t tlsf; // the heap's free lists
+  #endif
+  #if REALLOC_SLACK
+  struct grow_t grows[GROW_SLOTS]; // the heap's grow table
+  #endif
+  #if QUICK_LISTS
+  void *quick[QUICK_MAX_SIZE/ALIGNMENT + 1]; // the heap's quick lists
+  #endif
+};
+
+static struct arena_t arenas[ARENA_COUNT];
+// where arenas 1 and up live: (ARENA_COUNT-1)*ARENA_SPAN bytes, or NULL
+static char *arena_region;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+// the arena whose lock this thread holds, and the one it mallocs from
+static __thread struct arena_t *arena, *my_arena;
+// round robin for threads that can't go by cpu (or found theirs busy)
+static unsigned int arena_next;
+
+// bumped by every mm_init so that stale thread caches get dropped
+static unsigned long heap_generation = 1;
+static __thread struct tcache_t tcache;
+// only used to flush a thread's cache when the thread exits
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static inline void lock_arena(struct arena_t *a);
+static inline void lock_my_arena(void);
+static inline struct arena_t *arena_of(void *bp);
+#  define LOCK_HEAP() lock_my_arena()
+#  define LOCK_HEAP_OF(bp) lock_arena(arena_of(bp))
+#  define UNLOCK_HEAP() pthread_mutex_unlock(&arena->lock)
+#else
+#  define LOCK_HEAP()
+#  define LOCK_HEAP_OF(bp)
+#  define UNLOCK_HEAP()
+#endif
+
+#if STATS
+#  if THREAD_SAFE
+// one thread's counts, on a cache line of its own
+struct stat_shard_t
+{
+  struct mm_counts counts;
+} __attribute__((aligned(64)));
+static struct stat_shard_t stat_shards[STATS_SHARDS];
+static __thread struct mm_counts *stat_counts;
+static unsigned int stat_next;
+// this thread's shard (threads past STATS_SHARDS share, hence the atomics)
+static inline struct mm_counts *stat_shard(void) {
+  if (stat_counts == NULL)
+    stat_counts = &stat_shards[__sync_fetch_and_add(&stat_next, 1) % STATS_SHARDS].counts;
+  return stat_counts;
+}
+#    define STAT_ADD(field, n) __atomic_fetch_add(&stat_shard()->field, (n), __ATOMIC_RELAXED)
+#  else
+static struct mm_counts stat_counts;
+#    define STAT_ADD(field, n) (stat_counts.field += (n))
+#  endif
+#  define STAT(field) STAT_ADD(field, 1)
+#else
+#  define STAT(field)
+#endif
+
+#if STATS || PROFILE
+// tell live_bytes and the profiler about bp: on its way out to the caller
+// (who asked for size bytes), or on its way back
+static inline void *note_malloc(void *bp, size_t size);
+static inline void note_free(void *bp);
+#  define NOTE_MALLOC(bp, size) note_malloc((bp), (size))
+#  define NOTE_FREE(bp) note_free(bp)
+#else
+#  define NOTE_MALLOC(bp, size) (bp)
+#  define NOTE_FREE(bp)
+#endif
 
 
 /* Basic macro functions */
+// header bit that says the block before this one is allocated
+// (allocated blocks have no footer so this is the only place to find out)
+#define PREV_ALLOC (0x2)
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size_t)((size) | (alloc)))
 /* Read the size and allocated fields from an int */
 #define PACK_SIZE(packed)  ((packed) & ~(ALIGNMENT-1))
 #define PACK_IS_ALLOC(packed) ((packed) & 0x1)
+#define PACK_PREV_ALLOC(packed) ((packed) & PREV_ALLOC)
+// header bit of an allocated block that lives in its own mapping
+// (the header size is then the length of the whole mapping)
+#define MMAPPED (0x4)
+// the same bit on a free block says its interior pages have been released
+// (only allocated blocks are ever mapped so the two can't be confused)
+#define PURGED (0x4)
 /* point us to bp's header */
 #define HEADER(bp) (((size_t *)(bp))[-1])
 // or previous footer (for efficiency, because HEADER(PREV_BLKP) is hard)
@@ -129,7 +609,13 @@ void *last_block;
 // gets size/alloc from a pointer
 #define GET_SIZE(p)  PACK_SIZE(HEADER(p))
 #define IS_ALLOC(p)  PACK_IS_ALLOC(HEADER(p))
+#define IS_PREV_ALLOC(p) PACK_PREV_ALLOC(HEADER(p))
+#define IS_MMAPPED(p) (HEADER(p) & MMAPPED)
+#define IS_PURGED(p) (HEADER(p) & PURGED)
+// the word before the header of a mapped block: how far in the payload starts
+#define MAP_OFFSET(bp) (((size_t *)(bp))[-2])
 // slower functions
+// NOTE: only free blocks have a footer, allocated blocks use it as payload
 #define FOOTER(bp) (*((size_t *)(((char *)(bp)) + GET_SIZE(bp))))
 #define NEXT_BLKP(bp) ((char *)(bp) + DSIZE + GET_SIZE(bp))
 #define PREV_BLKP(bp) ((char *)(bp) - DSIZE - PACK_SIZE(PREV_FOOTER(bp)))
@@ -140,34 +626,127 @@ void *last_block;
 ///////////////
 
 static inline void *extend_heap(size_t bytes); /* grow heap bytes size */
+static int trim_heap(size_t pad); /* shrink a free last block down to ~pad */
+static inline void trim_top(void); /* trim_heap if the top has been free long enough */
+static inline void purge_block(void *bp); /* release a free block's pages */
 static inline void *coalesce(void *bp); /* merge newly free block with neighbors 
                                              and add to freelist */
 /* allocate asize at bp (possibly spliting) and remove from freelist */
 static inline void place(void* bp, size_t asize); 
 
 #if DEBUG
-int mm_check(void);
-int check_defines(void);
+static int mm_check(void);
+static int check_defines(void);
+static int sized_right(void *bp, size_t size);
 #endif
 
 // explicit freelist functions
 static void *freelist_add(void *bp);
 static void freelist_remove(void *bp);
 static void *freelist_bestfit(size_t sz);
+static void *freelist_alignedfit(size_t align, size_t skew, size_t sz);
+static inline long freelist_bin(size_t asize);
+
+#if SLAB
+// slab functions
+static void slab_init(unsigned long *map, size_t runs);
+static void *slab_malloc(size_t size);
+static void slab_free(void *p);
+#endif
+// allocates a block whose payload is skew bytes past an align boundary
+// (align a power of two, skew < align)
+static void *aligned_block(size_t align, size_t skew, size_t asize);
+
+// blocks that get a mapping of their own
+static void *mmap_block(size_t align, size_t size);
+static void munmap_block(void *bp);
+static void *mremap_block(void *bp, size_t size);
+
+#if REALLOC_SLACK
+// blocks realloc keeps growing
+static inline void grow_forget(void *bp);
+static int grow_trim(void);
+#endif
+
+#if QUICK_LISTS
+// freed blocks waiting to be coalesced
+static inline void quick_free(void *bp);
+static inline void *quick_malloc(size_t asize);
+static int quick_flush(void);
+#endif
+
+#if PROFILE
+// the heap profiler
+static inline void profile_malloc(void *bp, size_t size);
+static inline void profile_free(void *bp);
+static inline void profile_realloc(void *ptr, void *bp, size_t old, size_t size);
+static void profile_reset(void);
+static void profile_set_rate(size_t rate);
+static void profile_dump(int fd);
+#endif
+
+// the unlocked guts of the public calls (the heap lock must be held)
+static inline void *malloc_block(size_t size);
+static void *calloc_block(size_t size);
+static void *memalign_block(size_t align, size_t size);
+static inline void free_block(void *bp);
+static inline void free_heap_block(void *bp);
+static inline void release_block(void *bp);
+static size_t malloc_blocks(size_t n, const size_t *sizes, void **ptrs);
+static void free_blocks(size_t n, void **ptrs);
+static inline void *realloc_block(void *ptr, size_t size);
+
+// mem_sbrk for the heap we're working on (arenas past 0 have their own brk)
+static inline void *heap_sbrk(int incr) {
+  STAT(sbrks);
+  #if THREAD_SAFE
+    if (arena != &arenas[0]) {
+      char *old_brk = arena->brk;
+      if (old_brk + incr > arena->end) return (void *)-1;
+      arena->brk += incr;
+      if (arena->brk > arena->fresh) arena->fresh = arena->brk;
+      if (incr < 0) {
+        // like memlib, hand the pages we just dropped back to the OS
+        size_t page = mem_pagesize();
+        char *lo = (char *)(((size_t)arena->brk + page - 1) & ~(page - 1));
+        char *hi = (char *)((size_t)old_brk & ~(page - 1));
+        if (lo < hi) madvise(lo, hi - lo, MADV_DONTNEED);
+      }
+      return old_brk;
+    }
+  #endif
+  return mem_sbrk(incr);
+}
+
+// one past the last byte of the heap we're working on
+static inline char *heap_end(void) {
+  #if THREAD_SAFE
+    if (arena != &arenas[0]) return arena->brk;
+  #endif
+  return (char *)mem_heap_hi() + 1;
+}
+
+// where the memory the heap has never used starts. sbrk hands it out zeroed
+static inline char *heap_fresh(void) {
+  #if THREAD_SAFE
+    if (arena != &arenas[0]) return arena->fresh;
+  #endif
+  return (char *)mem_fresh_lo();
+}
 
 /* 
- * mm_init - initialize the malloc package.
+ * init_heap - initialize the malloc package.
  *   makes the bins and initial prologue / epilogue
  *   allocates _no_ initial free space
  */
-int mm_init(void)
+static int init_heap(void)
 {
    #if DEBUG>1
       fprintf(stderr, "Initializing heap with %d bins\n", BIT_COUNT);
    #endif
    void * space;
    /* Create the initial empty heap */
-   if ((space = mem_sbrk(ALIGN(sizeof(struct heaphead_t)))) == (void *)-1) {
+   if ((space = heap_sbrk(ALIGN(sizeof(struct heaphead_t)))) == (void *)-1) {
     #if DEBUG
        fprintf(stderr, "!! unable to sbrk the header!\n");
     #endif
@@ -175,10 +754,72 @@ int mm_init(void)
    }
    heap = (space + ALIGN(sizeof(struct heaphead_t)) - sizeof(struct heaphead_t));
    int a;
-   for (a = 0; a < BIT_COUNT; a++) {
-     heap->bins[a] = NULL;
-   }
-   heap->head[0] = heap->prologue[0] = heap->prologue[1] = PACK(0,1);
+   #if TLSF
+     #if !COMPACT_NODES
+       #if THREAD_SAFE
+         if (arena != &arenas[0])
+           heap->tlsf = &arena->tlsf;
+         else
+       #endif
+       heap->tlsf = &tlsf;
+     #endif
+     heap->tlsf->fl_map = 0;
+     for (a = 0; a < FL_COUNT; a++) {
+       heap->tlsf->sl_map[a] = 0;
+       memset(heap->tlsf->lists[a], 0, sizeof(heap->tlsf->lists[a]));
+     }
+   #else
+     for (a = 0; a < BIT_COUNT; a++) {
+       heap->bins[a] = NIL;
+     }
+     heap->binmap = 0;
+   #endif
+   #if HEAP_CHUNKS
+     heap->chunk = 0;
+     heap->since_miss = CHUNK_WINDOW;
+   #endif
+   #if TRIM_DELAY
+     heap->trim_since = 0;
+   #endif
+   #if REALLOC_SLACK
+     // kept outside the heap, like the slab map
+     #if THREAD_SAFE
+       if (arena != &arenas[0])
+         heap->grows = arena->grows;
+       else
+     #endif
+     heap->grows = grows;
+     for (a = 0; a < GROW_SLOTS; a++) {
+       heap->grows[a].bp = NULL;
+     }
+     heap->grow_count = 0;
+   #endif
+   #if QUICK_LISTS
+     #if THREAD_SAFE
+       if (arena != &arenas[0])
+         heap->quick = arena->quick;
+       else
+     #endif
+     heap->quick = quick;
+     for (a = 0; a <= QUICK_MAX_SIZE/ALIGNMENT; a++) {
+       heap->quick[a] = NULL;
+     }
+     heap->quick_count = 0;
+   #endif
+   #if SLAB
+     for (a = 0; a < SLAB_CLASSES; a++) {
+       heap->slabs[a] = NULL;
+     }
+     #if THREAD_SAFE
+       if (arena != &arenas[0])
+         // the map sits at the bottom of the arena's slice, below the heap
+         slab_init((unsigned long *)arena->start, ARENA_SPAN/SLAB_RUN_SIZE);
+       else
+     #endif
+     slab_init(slab_map, SLAB_SPAN/SLAB_RUN_SIZE);
+   #endif
+   heap->prologue[0] = heap->prologue[1] = PACK(0,1);
+   heap->head[0] = PACK(0, 1 | PREV_ALLOC);
 
    #if DEBUG
       if(check_defines()) {
@@ -186,25 +827,43 @@ int mm_init(void)
         return -1;
       }
    #endif
-  last_block = heap->head;
+  heap->last_block = heap->head;
   return 0;
 }
 
+#if HEAP_CHUNKS
+// how much extra to grow the heap by on this miss (see HEAP_CHUNKS)
+static inline size_t heap_chunk(void) {
+  size_t chunk = heap->chunk;
+  if (heap->since_miss < CHUNK_WINDOW) {
+    chunk = (chunk < CHUNK_MIN) ? CHUNK_MIN : 2*chunk;
+  } else {
+    chunk /= 2;
+  }
+  size_t cap = (heap_end() - (char *)heap) / CHUNK_FRACTION;
+  if (cap > CHUNK_MAX) cap = CHUNK_MAX;
+  if (chunk > cap) chunk = (cap < CHUNK_MIN) ? 0 : cap;
+  heap->chunk = chunk;
+  heap->since_miss = 0;
+  return chunk & ~(ALIGNMENT-1);
+}
+#endif
+
 // extends the size of the last block in the heap to be at least asize
 static inline void *extend_block(size_t asize) {
   #if DEBUG>1
-  fprintf(stderr, "Extending %p (size=%lx) to size %lx\n", last_block, GET_SIZE(last_block), asize);
+  fprintf(stderr, "Extending %p (size=%lx) to size %lx\n", heap->last_block, GET_SIZE(heap->last_block), asize);
   #endif
-  size_t csize = GET_SIZE(last_block);
-  if (csize >= asize) return last_block;
+  size_t csize = GET_SIZE(heap->last_block);
+  if (csize >= asize) return heap->last_block;
   size_t diff = asize - csize;
-  void *old_end = mem_sbrk(diff);
+  void *old_end = heap_sbrk(diff);
   if (old_end == (void*)-1) return NULL;
-  size_t *epilogue = old_end - DSIZE + diff;
-  epilogue[1] = PACK(0,1);
-  epilogue[0] = PACK(asize, IS_ALLOC(last_block));
-  HEADER(last_block) = epilogue[0];
-  return last_block;
+  size_t alloc = IS_ALLOC(heap->last_block);
+  HEADER(heap->last_block) = PACK(asize, alloc | IS_PREV_ALLOC(heap->last_block));
+  if (!alloc) FOOTER(heap->last_block) = PACK(asize, 0);
+  HEADER(NEXT_BLKP(heap->last_block)) = PACK(0, 1 | (alloc ? PREV_ALLOC : 0));
+  return heap->last_block;
 }
 
 // extends the heap by bytes. NOTE: doesn't change the freelist
@@ -222,32 +881,159 @@ static inline void *extend_heap(size_t bytes) {
   #endif
   /* Allocate an even number of words to maintain alignment */
   size = ALIGN(bytes);
-  if (!IS_ALLOC(last_block)) {
+  #if TRIM_DELAY
+    // whatever was free at the top wasn't enough, so it's being used
+    heap->trim_since = 0;
+  #endif
+  #if HEAP_CHUNKS
+    // grow by an extra chunk if we can, by just what we need if we can't
+    size_t chunk = heap_chunk();
+  #endif
+  if (!IS_ALLOC(heap->last_block)) {
     #if DEBUG>1
-    fprintf(stderr, "extending the heap via the last free block %p (header=%lx)\n", last_block, HEADER(last_block));
+    fprintf(stderr, "extending the heap via the last free block %p (header=%lx)\n", heap->last_block, HEADER(heap->last_block));
+    #endif
+    freelist_remove(heap->last_block);
+    #if HEAP_CHUNKS
+      if (chunk > 0 && (bp = extend_block(size + chunk)) != NULL)
+        return bp;
     #endif
-    freelist_remove(last_block);
-    return extend_block(size);
+    if ((bp = extend_block(size)) == NULL)
+      freelist_add(heap->last_block);
+    return bp;
   }
 
-  if ((long)(bp = mem_sbrk(DSIZE+size)) == -1)
+  #if HEAP_CHUNKS
+    if (chunk > 0 && (long)(bp = heap_sbrk(DSIZE+size+chunk)) != -1)
+      size += chunk;
+    else
+  #endif
+  if ((long)(bp = heap_sbrk(DSIZE+size)) == -1)
       return NULL;
   /* Initialize free block header/footer and the epilogue header */
-  HEADER(bp) = PACK(size, 0); /* Free block header */
-  FOOTER(bp) = HEADER(bp);     /* Free block footer */
+  HEADER(bp) = PACK(size, IS_PREV_ALLOC(bp)); /* Free block header */
+  FOOTER(bp) = PACK(size, 0);     /* Free block footer */
   HEADER(NEXT_BLKP(bp)) = PACK(0, 1); /* New epilogue header */
   // coallescing here didn't help efficiency in testing
-  return last_block = bp;
+  return heap->last_block = bp;
+}
+
+// gives the pages at the end of a free last block back to memlib, keeping
+// at least pad bytes of it. returns 1 if the heap got any smaller
+// NOTE: the last block itself never goes away (we couldn't find the one
+//       before it if that is allocated) it just shrinks
+static int trim_heap(size_t pad) {
+  if (IS_ALLOC(heap->last_block)) return 0;
+  size_t size = GET_SIZE(heap->last_block);
+  size_t keep = (pad < MIN_SIZE) ? MIN_SIZE : ALIGN(pad);
+  if (size <= keep) return 0;
+  // only whole pages are worth giving back
+  size_t release = (size - keep) & ~(mem_pagesize() - 1);
+  if (release == 0) return 0;
+  #if DEBUG>1
+    fprintf(stderr, "trimming %lx bytes off the last block %p\n", release, heap->last_block);
+  #endif
+  freelist_remove(heap->last_block);
+  size -= release;
+  while (release > 0) {
+    // sbrk only takes an int
+    size_t chunk = (release > (INT_MAX & ~(mem_pagesize() - 1))) ?
+      (INT_MAX & ~(mem_pagesize() - 1)) : release;
+    heap_sbrk(-(int)chunk);
+    release -= chunk;
+  }
+  HEADER(heap->last_block) = PACK(size, IS_PREV_ALLOC(heap->last_block) | IS_PURGED(heap->last_block));
+  FOOTER(heap->last_block) = PACK(size, 0);
+  HEADER(NEXT_BLKP(heap->last_block)) = PACK(0, 1); /* New epilogue header */
+  freelist_add(heap->last_block);
+  #if HEAP_CHUNKS
+    heap->chunk /= 2;
+  #endif
+  #if TRIM_DELAY
+    heap->trim_since = 0;
+  #endif
+  return 1;
+}
+
+#if TRIM_DELAY
+// milliseconds on a clock that only goes forward (never 0)
+static inline size_t heap_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (size_t)ts.tv_sec*1000 + ts.tv_nsec/1000000 + 1;
+}
+#endif
+
+// a free just left the last block free and at least TRIM_THRESHOLD bytes.
+// trims it if that has been so (as far as frees can tell) for TRIM_DELAY ms
+static inline void trim_top(void) {
+  #if TRIM_DELAY
+    size_t now = heap_clock();
+    if (heap->trim_since == 0) {
+      heap->trim_since = now;
+      return;
+    }
+    if (now - heap->trim_since < TRIM_DELAY) return;
+  #endif
+  trim_heap(TRIM_PAD);
+}
+
+// the whole pages of free block bp between its freenode fields and its footer
+static inline void purge_range(void *bp, char **lo, char **hi) {
+  size_t page = mem_pagesize();
+  *lo = (char *)(((size_t)bp + sizeof(struct freenode_t) + page - 1) & ~(page - 1));
+  *hi = (char *)(((size_t)bp + GET_SIZE(bp)) & ~(page - 1));
 }
 
-void mm_free(void *bp){
+// hands the whole pages inside a large free block back to the OS. the header,
+// the freenode fields and the footer stay put so the block is still a normal
+// member of the heap and the trie; the pages just come back zeroed on reuse.
+// PURGED remembers that it's been done so we don't make the syscall again
+static inline void purge_block(void *bp) {
+  size_t size = GET_SIZE(bp);
+  char *lo, *hi;
+  if (size < PURGE_THRESHOLD || IS_PURGED(bp)) return;
+  purge_range(bp, &lo, &hi);
+  #if DEBUG>1
+    fprintf(stderr, "purging %p (size=%lx) pages %p to %p\n", bp, size, lo, hi);
+  #endif
+  if (lo < hi) madvise(lo, hi - lo, MADV_DONTNEED);
+  HEADER(bp) |= PURGED;
+}
+
+static inline void free_block(void *bp){
+  #if SLAB
+    if (IS_SLAB(bp)) {
+      slab_free(bp);
+      return;
+    }
+  #endif
+  if (IS_MMAPPED(bp)) {
+    munmap_block(bp);
+    return;
+  }
+  free_heap_block(bp);
+}
+
+// free_block for a block we already know is neither a slot nor mapped
+static inline void free_heap_block(void *bp) {
   size_t size = GET_SIZE(bp);
   #if DEBUG>1
     fprintf(stderr, "Call to free with pointer %p (size: %lx)\n", bp, size);
   #endif
-  HEADER(bp) = PACK(size, 0);
-  FOOTER(bp) = PACK(size, 0); 
-  coalesce(bp);
+  #if REALLOC_SLACK
+    grow_forget(bp);
+  #endif
+  #if QUICK_LISTS
+    if (size <= QUICK_MAX_SIZE)
+      quick_free(bp);
+    else
+  #endif
+  {
+    HEADER(bp) = PACK(size, IS_PREV_ALLOC(bp));
+    FOOTER(bp) = PACK(size, 0); 
+    release_block(bp);
+  }
   #if DEBUG
     if (!mm_check()) {
       fprintf(stderr, "!!!!!!!!!mm_check failed!!!!!!!!\n");
@@ -255,55 +1041,118 @@ void mm_free(void *bp){
   #endif
 }
 
+// the rest of free_block once bp's header and footer say it's free:
+// merge it into the trie, then trim / purge it if it's big enough
+static inline void release_block(void *bp) {
+  bp = coalesce(bp);
+  if (bp == heap->last_block && GET_SIZE(bp) >= TRIM_THRESHOLD) {
+    trim_top();
+  }
+  #if PURGE
+    purge_block(bp);
+  #endif
+}
+
+#if QUICK_LISTS
+// puts heap block bp on the quick list for its size. It stays marked
+// allocated, so nothing coalesces with it until quick_flush
+static inline void quick_free(void *bp) {
+  void **q = &heap->quick[GET_SIZE(bp)/ALIGNMENT];
+  *(void **)bp = *q;
+  *q = bp;
+  if (++heap->quick_count >= QUICK_COUNT) quick_flush();
+}
+
+// a block of exactly asize off the quick lists (or NULL). It's still
+// marked allocated so it can go straight back to the caller
+static inline void *quick_malloc(size_t asize) {
+  void **q, *bp;
+  if (asize > QUICK_MAX_SIZE) return NULL;
+  q = &heap->quick[asize/ALIGNMENT];
+  if ((bp = *q) != NULL) {
+    *q = *(void **)bp;
+    heap->quick_count--;
+  }
+  return bp;
+}
+
+// frees every block on the quick lists for real, coalescing them into the
+// trie. returns 1 if there was anything to free
+static int quick_flush(void) {
+  size_t c;
+  if (heap->quick_count == 0) return 0;
+  #if DEBUG>1
+    fprintf(stderr, "flushing %lu blocks off the quick lists\n", heap->quick_count);
+  #endif
+  for (c = 0; c <= QUICK_MAX_SIZE/ALIGNMENT; c++) {
+    while (heap->quick[c] != NULL) {
+      void *bp = heap->quick[c];
+      heap->quick[c] = *(void **)bp;
+      heap->quick_count--;
+      HEADER(bp) = PACK(GET_SIZE(bp), IS_PREV_ALLOC(bp));
+      FOOTER(bp) = PACK(GET_SIZE(bp), 0);
+      release_block(bp);
+    }
+  }
+  return 1;
+}
+#endif
+
 
-// coalesce takes a pointer to a block
+// coalesce takes a pointer to a free block (header and footer written)
 // that is NOT in the free list
 // tries to merge it with its neighbors
 // and then adds the new block to the freelist
 // returning a pointer to that newly added block
+// (a merged block is never PURGED: the seams between the pieces are still
+// resident, so the next purge_block has to do the whole thing again)
 static inline void *coalesce(void *bp)
 {
   void *next = NEXT_BLKP(bp);
-  int prev_alloc = PACK_IS_ALLOC(PREV_FOOTER(bp));
+  int prev_alloc = IS_PREV_ALLOC(bp);
   int next_alloc = IS_ALLOC(next);
   size_t size = GET_SIZE(bp);
   if (prev_alloc && next_alloc) {
-    // no op
+    STAT(coalesce[0]);
   }
   else if (prev_alloc && !next_alloc) {
     #if DEBUG>1
       fprintf(stderr, "Coalescing %p with next block\n", bp);
     #endif
+    STAT(coalesce[1]);
     freelist_remove(next);
     size += DSIZE + GET_SIZE(next);
-    if (last_block == next) last_block = bp;
-    HEADER(bp) = PACK(size, 0);
+    if (heap->last_block == next) heap->last_block = bp;
+    HEADER(bp) = PACK(size, PREV_ALLOC);
     FOOTER(bp) = PACK(size, 0);
   }
   else if (!prev_alloc && next_alloc) {
     #if DEBUG>1
       fprintf(stderr, "Coalescing %p with previous block\n", bp);
     #endif
+    STAT(coalesce[2]);
     freelist_remove(PREV_BLKP(bp));
-    if (last_block == bp) last_block = PREV_BLKP(bp);
+    if (heap->last_block == bp) heap->last_block = PREV_BLKP(bp);
     size += DSIZE + PACK_SIZE(PREV_FOOTER(bp));
     FOOTER(bp) = PACK(size, 0);
     bp = PREV_BLKP(bp);
-    HEADER(bp) = PACK(size, 0);
+    HEADER(bp) = PACK(size, PREV_ALLOC);
   }
   else {
     #if DEBUG>1
       fprintf(stderr, "Coalescing %p with neighboring blocks\n", bp);
     #endif
+    STAT(coalesce[3]);
     bp = PREV_BLKP(bp);
-    if (last_block == next) last_block = bp;
+    if (heap->last_block == next) heap->last_block = bp;
     freelist_remove(bp);
     freelist_remove(next);
     size += GET_SIZE(bp) +
       GET_SIZE(next) + (DSIZE*2);
-    HEADER(bp) = PACK(size, 0);
+    HEADER(bp) = PACK(size, PREV_ALLOC);
     FOOTER(next) = PACK(size, 0);
   }
+  HEADER(NEXT_BLKP(bp)) &= ~PREV_ALLOC;
   bp = freelist_add(bp); 
   #if DEBUG
     if (!mm_check()) {
@@ -313,10 +1162,63 @@ static inline void *coalesce(void *bp)
   return bp;
 }
 
-// mm_malloc: this is the primary malloc call
+// turns a requested size into the block size we actually hand out
+// (the payload of an allocated block runs on into where its footer would be)
+static inline size_t adjust_size(size_t size) {
+  size = ALIGN(size + WSIZE) - DSIZE;
+  if (size < MIN_SIZE)
+    return MIN_SIZE;
+  return size;
+}
+
+// how many bytes the caller may actually use at bp
+static inline size_t usable_size(void *bp) {
+  #if SLAB
+    if (IS_SLAB(bp)) {
+      return SLAB_RUN(bp)->slot_size;
+    }
+  #endif
+  if (IS_MMAPPED(bp)) {
+    return GET_SIZE(bp) - MAP_OFFSET(bp);
+  }
+  return GET_SIZE(bp) + WSIZE;
+}
+
+#if STATS || PROFILE
+// usable_size from outside the heap lock
+static inline size_t note_usable(void *bp) {
+  if (bp == NULL) return 0;
+  #if THREAD_SAFE
+    // enough to look at bp's slab map, like mm_free
+    heap = arena_of(bp)->heap;
+  #endif
+  return usable_size(bp);
+}
+
+static inline void *note_malloc(void *bp, size_t size) {
+  #if STATS
+    STAT_ADD(live_bytes, note_usable(bp));
+  #endif
+  #if PROFILE
+    if (bp != NULL) profile_malloc(bp, size);
+  #endif
+  return bp;
+}
+
+static inline void note_free(void *bp) {
+  #if STATS
+    STAT_ADD(live_bytes, -note_usable(bp));
+  #endif
+  #if PROFILE
+    profile_free(bp);
+  #endif
+}
+#endif
+
+// malloc_block: this is the primary malloc call
 // it only allocates new space on the heap as a last resort
-// and then only does it as much as necessary
-void *mm_malloc(size_t size)
+// and then only does it as much as necessary (plus a chunk, see HEAP_CHUNKS)
+static inline void *malloc_block(size_t size)
 {
   #if DEBUG>1
     fprintf(stderr, "+malloc called with size=%lx\n", size);
@@ -325,19 +1227,33 @@ void *mm_malloc(size_t size)
   // Ignore spurious requests
   if (size == 0)
     return NULL;
-  if (size > MAX_SIZE) {
-    #if DEBUG
-      fprintf(stderr, "!! malloc called with size %lx > %lx\n", size, MAX_SIZE);
-    #endif
-    return NULL;
+  #if SLAB
+    if (size <= SLAB_MAX_SIZE && (bp = slab_malloc(size)) != NULL) {
+      return bp;
+    }
+  #endif
+  if (size >= MMAP_THRESHOLD || size > MAX_SIZE) {
+    return mmap_block(ALIGNMENT, size);
   }
   /* Adjust block size to include overhead and alignment reqs. */
-  if (size < MIN_SIZE)
-    size = MIN_SIZE;
-  else
-    size = ALIGN(size);
+  size = adjust_size(size);
+  #if HEAP_CHUNKS
+    heap->since_miss++;
+  #endif
+  #if QUICK_LISTS
+    if ((bp = quick_malloc(size)) != NULL) {
+      return bp;
+    }
+  #endif
   /* Search the free list for a fit */
-  if ((bp = freelist_bestfit(size)) != NULL) {
+  bp = freelist_bestfit(size);
+  #if QUICK_LISTS
+    // nothing fits: see what the deferred frees coalesce into first
+    if (bp == NULL && quick_flush()) {
+      bp = freelist_bestfit(size);
+    }
+  #endif
+  if (bp != NULL) {
     freelist_remove(bp);
     place(bp, size);
   } else {
@@ -345,6 +1261,13 @@ void *mm_malloc(size_t size)
     if ((bp = extend_heap(size)) != NULL) {
       place(bp, size);
     }
+  #if REALLOC_SLACK
+    // out of memory: take back the slack realloc handed out and look again
+    else if (grow_trim() && (bp = freelist_bestfit(size)) != NULL) {
+      freelist_remove(bp);
+      place(bp, size);
+    }
+  #endif
   #if DEBUG
     else {
       fprintf(stderr, "!!! MALLOC FAILED!!! !!!!\n");
@@ -363,68 +1286,568 @@ void *mm_malloc(size_t size)
 // actually allocate this block with size asize
 // splitting off freespace on the end if necessary
 static inline void place(void* bp, size_t asize) {
+  #if TRIM_DELAY
+    // the top is being handed out again, so its wait for a trim starts over
+    if (bp == heap->last_block) heap->trim_since = 0;
+  #endif
   size_t csize = GET_SIZE(bp);
+  size_t prev_alloc = IS_PREV_ALLOC(bp);
+  // the remainder of a purged block is still purged
+  size_t purged = IS_ALLOC(bp) ? 0 : IS_PURGED(bp);
   if ((csize - asize) >= MIN_SIZE + DSIZE) {
-    HEADER(bp) = PACK(asize, 1);
-    FOOTER(bp) = PACK(asize, 1);
-    if (bp == last_block) last_block = bp = NEXT_BLKP(bp);
+    STAT(splits);
+    HEADER(bp) = PACK(asize, 1 | prev_alloc);
+    if (bp == heap->last_block) heap->last_block = bp = NEXT_BLKP(bp);
     else bp = NEXT_BLKP(bp);
     csize = csize - asize - DSIZE;
-    HEADER(bp) = PACK(csize, 0);
+    HEADER(bp) = PACK(csize, PREV_ALLOC | purged);
     FOOTER(bp) = PACK(csize, 0);
-    freelist_add(bp);
+    // realloc can shrink a block whose next neighbor is free
+    coalesce(bp);
   } else {
-    HEADER(bp) = PACK(csize, 1);
-    FOOTER(bp) = PACK(csize, 1);
+    HEADER(bp) = PACK(csize, 1 | prev_alloc);
+    HEADER(NEXT_BLKP(bp)) |= PREV_ALLOC;
   }
 }
 
-// a simple realloc that only allocates new space and copies
-void *dumb_realloc(void *ptr, size_t size) {
-    void *oldptr = ptr;
-    void *newptr;
-    size_t copySize;
-    
-    newptr = mm_malloc(size);
-    if (newptr == NULL)
-      return NULL;
-    copySize = GET_SIZE(oldptr);
-    if (size < copySize)
-      copySize = size;
-    memcpy(newptr, oldptr, copySize);
-    mm_free(oldptr);
-    return newptr;
+// zeroes the first size bytes of allocated block bp, except for [lo, hi)
+// which is known to be zero already. The word where bp's footer would go is
+// never taken on trust: extend_heap / extend_block write a footer there
+static inline void zero_block(char *bp, size_t size, char *lo, char *hi) {
+  char *end = bp + size;
+  if (hi > bp + GET_SIZE(bp)) hi = bp + GET_SIZE(bp);
+  if (hi > end) hi = end;
+  if (lo < bp) lo = bp;
+  if (lo >= hi) {
+    memset(bp, 0, size);
+    return;
+  }
+  memset(bp, 0, lo - bp);
+  memset(hi, 0, end - hi);
 }
 
-// smart realloc that attempts to leave the block in place if at all possible
-void *mm_realloc(void *ptr, size_t size)
+// malloc_block for calloc. Memory the heap has never had (past heap_fresh)
+// and the released pages of a purged block come back from the OS zeroed, so
+// only the rest of the block gets a memset
+static void *calloc_block(size_t size)
 {
-    #if DEBUG>1
-      fprintf(stderr, "reallocing block %p (size %lx) with new size %lx\n", ptr, GET_SIZE(ptr), size);
-    #endif
-    size = ALIGN(size);
-    long diff = size - GET_SIZE(ptr);
-    if (diff <= 0) {
-      // resize in-place by freeing the part after it
-      place(ptr, size);
-    } else {
-      void *nxt_block = NEXT_BLKP(ptr);
-      if ((!IS_ALLOC(nxt_block)) && (DSIZE + GET_SIZE(nxt_block) >= diff)) {
-          // resize in place with next block
-          freelist_remove(nxt_block);
-          size_t csize = DSIZE + GET_SIZE(nxt_block) + GET_SIZE(ptr);
-          HEADER(ptr) = PACK(csize, 1);
-          FOOTER(ptr) = PACK(csize, 1);
-          place(ptr, size);
+  char *bp, *lo = NULL, *hi = NULL;
+  if (size == 0)
+    return NULL;
+  #if SLAB
+    if (size <= SLAB_MAX_SIZE && (bp = slab_malloc(size)) != NULL) {
+      memset(bp, 0, size);
+      return bp;
+    }
+  #endif
+  if (size >= MMAP_THRESHOLD || size > MAX_SIZE) {
+    // a new mapping is all zero pages
+    return mmap_block(ALIGNMENT, size);
+  }
+  size_t asize = adjust_size(size);
+  #if HEAP_CHUNKS
+    heap->since_miss++;
+  #endif
+  #if QUICK_LISTS
+    if ((bp = quick_malloc(asize)) != NULL) {
+      memset(bp, 0, size);
+      return bp;
+    }
+  #endif
+  bp = freelist_bestfit(asize);
+  #if QUICK_LISTS
+    if (bp == NULL && quick_flush()) {
+      bp = freelist_bestfit(asize);
+    }
+  #endif
+  if (bp != NULL) {
+    if (IS_PURGED(bp)) purge_range(bp, &lo, &hi);
+    freelist_remove(bp);
+    place(bp, asize);
+  } else {
+    lo = heap_fresh();
+    if ((bp = extend_heap(asize)) == NULL)
+      return NULL;
+    place(bp, asize);
+    hi = heap_end();
+  }
+  zero_block(bp, size, lo, hi);
+  #if DEBUG
+    if (!mm_check()) {
+      fprintf(stderr, "!!!!!!!!! mm_check failed !!!!!!!!!!\n");
+    }
+  #endif
+  return bp;
+}
+
+// the first payload address at or after bp that is skew past an align
+// boundary and leaves room for a free block in front of it
+static inline char *aligned_payload(char *bp, size_t align, size_t skew) {
+  if ((((size_t)bp - skew) & (align-1)) == 0)
+    return bp;
+  return (char *)(((((size_t)bp) - skew + MIN_SIZE + DSIZE + align - 1) & ~(align-1)) + skew);
+}
+
+// does free block bp have room for asize bytes skew past an align boundary
+static inline int aligned_fits(char *bp, size_t align, size_t skew, size_t asize) {
+  return (aligned_payload(bp, align, skew) - bp) + asize <= GET_SIZE(bp);
+}
+
+// allocates a block of asize whose payload starts skew bytes past an align
+// boundary (0 for plain alignment). Any misaligned front of the block we use
+// is split off as its own free block so it has to be able to hold one (hence
+// the MIN_SIZE + DSIZE of slack)
+static void *aligned_block(size_t align, size_t skew, size_t asize) {
+  char *bp, *ap;
+  #if DEBUG>1
+    fprintf(stderr, "aligned block of size %lx at alignment %lx\n", asize, align);
+  #endif
+  if ((bp = freelist_alignedfit(align, skew, asize)) != NULL) {
+    freelist_remove(bp);
+    ap = aligned_payload(bp, align, skew);
+  } else {
+    // grow the heap by just what it takes to line up the end of it
+    bp = IS_ALLOC(heap->last_block) ? heap_end() : (char *)heap->last_block;
+    ap = aligned_payload(bp, align, skew);
+    if ((bp = extend_heap((ap - bp) + asize)) == NULL)
+      return NULL;
+  }
+  if (ap != bp) {
+    size_t csize = GET_SIZE(bp);
+    size_t fsize = ap - bp - DSIZE;
+    // claim the aligned part first so the front doesn't coalesce into it
+    HEADER(ap) = PACK(csize - fsize - DSIZE, 1);
+    HEADER(NEXT_BLKP(ap)) |= PREV_ALLOC;
+    if (heap->last_block == bp) heap->last_block = ap;
+    HEADER(bp) = PACK(fsize, IS_PREV_ALLOC(bp) | IS_PURGED(bp));
+    FOOTER(bp) = PACK(fsize, 0);
+    coalesce(bp);
+  }
+  place(ap, asize);
+  return ap;
+}
+
+// malloc_block with the payload on an align boundary (a power of two)
+static void *memalign_block(size_t align, size_t size)
+{
+  char *bp;
+  if (size == 0)
+    return NULL;
+  if (align <= ALIGNMENT)
+    return malloc_block(size);
+  // past a page, lining up in the heap can cost up to align bytes of it
+  // each time, while a mapping is already page aligned and can give back
+  // whatever it didn't need
+  if (size >= MMAP_THRESHOLD || size > MAX_SIZE || align > mem_pagesize()) {
+    return mmap_block(align, size);
+  }
+  // (no slabs: a slot is only as aligned as its slot size)
+  bp = aligned_block(align, 0, adjust_size(size));
+  #if DEBUG
+    if (bp == NULL) {
+      fprintf(stderr, "!!! MEMALIGN FAILED!!! !!!!\n");
+    }
+    if (!mm_check()) {
+      fprintf(stderr, "!!!!!!!!! mm_check failed !!!!!!!!!!\n");
+    }
+  #endif
+  return bp;
+}
+
+// would malloc_block put a request of size in a block of the heap
+static inline int heap_sized(size_t size) {
+  #if SLAB
+    if (size <= SLAB_MAX_SIZE) return 0;
+  #endif
+  return size != 0 && size < MMAP_THRESHOLD && size <= MAX_SIZE;
+}
+
+// malloc_block for the requests among n whose ptrs[i] is still NULL,
+// returning how many it allocated. When a run of requests wants the same
+// block size and the trie has an exact fit, the rest of the run comes
+// straight off that size's stack instead of each one searching the trie again
+// (a TLSF list can hold other sizes too, so we stop at the first of those)
+static size_t malloc_blocks(size_t n, const size_t *sizes, void **ptrs) {
+  size_t i = 0, got = 0;
+  while (i < n) {
+    size_t asize = adjust_size(sizes[i]);
+    struct freenode_t *node;
+    if (ptrs[i] != NULL) {
+      i++;
+      continue;
+    }
+    if (!heap_sized(sizes[i]) || (node = freelist_bestfit(asize)) == NULL ||
+        GET_SIZE(node) != asize) {
+      if ((ptrs[i] = malloc_block(sizes[i])) != NULL) got++;
+      i++;
+      continue;
+    }
+    do {
+      link_t next = node->next;
+      freelist_remove(node);
+      place(node, asize);
+      ptrs[i++] = node;
+      got++;
+      node = (next != NIL) ? NODE(next) : NULL;
+    } while (node != NULL && GET_SIZE(node) == asize && i < n && ptrs[i] == NULL &&
+             heap_sized(sizes[i]) && adjust_size(sizes[i]) == asize);
+  }
+  #if DEBUG
+    if (!mm_check()) {
+      fprintf(stderr, "!!!!!!!!! mm_check failed !!!!!!!!!!\n");
+    }
+  #endif
+  return got;
+}
+
+// free_block for n blocks of this heap, sorted by address. Blocks that sit
+// back to back are made into one free block before it's merged with its
+// neighbors, instead of each one going into the trie and back out again
+static void free_blocks(size_t n, void **ptrs) {
+  size_t i = 0;
+  while (i < n) {
+    char *bp = ptrs[i++], *end;
+    if (bp == NULL) continue;
+    #if SLAB
+      if (IS_SLAB(bp)) {
+        slab_free(bp);
+        continue;
+      }
+    #endif
+    if (IS_MMAPPED(bp)) {
+      munmap_block(bp);
+      continue;
+    }
+    #if REALLOC_SLACK
+      grow_forget(bp);
+    #endif
+    for (end = NEXT_BLKP(bp); i < n && ptrs[i] == end; end = NEXT_BLKP(end), i++) {
+      if (end == heap->last_block) heap->last_block = bp;
+      #if REALLOC_SLACK
+        grow_forget(end);
+      #endif
+    }
+    size_t size = end - bp - DSIZE;
+    HEADER(bp) = PACK(size, IS_PREV_ALLOC(bp));
+    FOOTER(bp) = PACK(size, 0);
+    release_block(bp);
+  }
+  #if DEBUG
+    if (!mm_check()) {
+      fprintf(stderr, "!!!!!!!!!mm_check failed!!!!!!!!\n");
+    }
+  #endif
+}
+
+// qsort order for free batches
+static int address_order(const void *a, const void *b) {
+  char *x = *(char * const *)a, *y = *(char * const *)b;
+  return (x > y) - (x < y);
+}
+
+// sorts a free batch by address. Blocks that were malloced together are
+// mostly in order already, which insertion sort gets through in about one
+// pass, so qsort is only for big batches
+static void sort_by_address(size_t n, void **ptrs) {
+  size_t i, j;
+  if (n > 64) {
+    qsort(ptrs, n, sizeof(void *), address_order);
+    return;
+  }
+  for (i = 1; i < n; i++) {
+    void *p = ptrs[i];
+    for (j = i; j > 0 && (char *)ptrs[j - 1] > (char *)p; j--) {
+      ptrs[j] = ptrs[j - 1];
+    }
+    ptrs[j] = p;
+  }
+}
+
+// length of the mapping that holds size bytes of payload (0 if too large)
+static inline size_t map_length(size_t size) {
+  size_t page = mem_pagesize();
+  size_t len = (size + DSIZE + page - 1) & ~(page - 1);
+  return (len < size) ? 0 : len;
+}
+
+// gives a block its very own anonymous mapping
+// the payload starts at the first align boundary at least DSIZE in, after the
+// offset word and the header. For a big align we map align extra bytes and
+// give back the whole pages on either side of the block that we didn't use
+static void *mmap_block(size_t align, size_t size) {
+  size_t page = mem_pagesize();
+  size_t len = map_length((align > DSIZE) ? size + align - DSIZE : size);
+  char *map, *bp, *lo, *hi;
+  #if DEBUG>1
+    fprintf(stderr, "mapping %lx bytes for a block of size %lx\n", len, size);
+  #endif
+  if (len == 0)
+    return NULL;
+  map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  bp = (char *)(((size_t)map + DSIZE + align - 1) & ~(align - 1));
+  lo = (char *)(((size_t)bp - DSIZE) & ~(page - 1));
+  hi = (char *)(((size_t)bp + size + page - 1) & ~(page - 1));
+  if (lo > map) munmap(map, lo - map);
+  if (hi < map + len) munmap(hi, map + len - hi);
+  MAP_OFFSET(bp) = bp - lo;
+  HEADER(bp) = PACK(hi - lo, 1 | MMAPPED);
+  return bp;
+}
+
+static void munmap_block(void *bp) {
+  #if DEBUG>1
+    fprintf(stderr, "unmapping block %p (mapping size %lx)\n", bp, GET_SIZE(bp));
+  #endif
+  munmap((char *)bp - MAP_OFFSET(bp), GET_SIZE(bp));
+}
+
+// resizes the mapping of a mapped block (letting the kernel move it)
+static void *mremap_block(void *bp, size_t size) {
+  size_t offset = MAP_OFFSET(bp);
+  size_t oldlen = GET_SIZE(bp);
+  size_t len = map_length(size + offset - DSIZE);
+  char *map;
+  if (len == 0)
+    return NULL;
+  if (len == oldlen)
+    return bp;
+  #ifdef MREMAP_MAYMOVE
+    map = mremap((char *)bp - offset, oldlen, len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+      return NULL;
+  #else
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+      return NULL;
+    memcpy(map, (char *)bp - offset, (len < oldlen) ? len : oldlen);
+    munmap((char *)bp - offset, oldlen);
+  #endif
+  bp = map + offset;
+  HEADER(bp) = PACK(len, 1 | MMAPPED);
+  return bp;
+}
+
+// grows ptr to asize (or as close to rsize as fits) by merging it with the
+// free block in front of it (and the one after it, if that is free too) and
+// moving the payload down. The caller has checked that the merged block
+// holds asize
+static inline void *realloc_down(void *ptr, size_t asize, size_t rsize) {
+  void *prev = PREV_BLKP(ptr);
+  void *next = NEXT_BLKP(ptr);
+  size_t usable = GET_SIZE(ptr) + WSIZE;
+  size_t csize = GET_SIZE(prev) + DSIZE + GET_SIZE(ptr);
+  freelist_remove(prev);
+  if (!IS_ALLOC(next)) {
+    freelist_remove(next);
+    if (heap->last_block == next) heap->last_block = prev;
+    csize += DSIZE + GET_SIZE(next);
+  }
+  HEADER(prev) = PACK(csize, 1 | IS_PREV_ALLOC(prev));
+  memmove(prev, ptr, usable);
+  // split only once the payload is out of the way
+  place(prev, (rsize < csize) ? rsize : csize);
+  return prev;
+}
+
+#if REALLOC_SLACK
+// the slot of heap->grows that bp hashes to
+static inline struct grow_t *grow_slot(void *bp) {
+  return &heap->grows[(((size_t)bp / ALIGNMENT) ^ ((size_t)bp >> 12)) % GROW_SLOTS];
+}
+
+// stops tracking bp (it's being freed, or it stopped growing)
+static inline void grow_forget(void *bp) {
+  struct grow_t *g;
+  if (heap->grow_count == 0) return;
+  g = grow_slot(bp);
+  if (g->bp == bp) {
+    g->bp = NULL;
+    heap->grow_count--;
+  }
+}
+
+// starts tracking bp, which realloc just grew to fit size (count grows in
+// a row). whoever had the slot before is dropped
+static inline void grow_note(void *bp, size_t size, size_t count) {
+  struct grow_t *g = grow_slot(bp);
+  if (g->bp == NULL) heap->grow_count++;
+  g->bp = bp;
+  g->bsize = GET_SIZE(bp);
+  g->size = size;
+  g->count = count;
+}
+
+// for when the heap can't grow: cuts every tracked block back down to what
+// its caller asked for. returns 1 if that freed anything
+static int grow_trim(void) {
+  int a, trimmed = 0;
+  for (a = 0; a < GROW_SLOTS && heap->grow_count > 0; a++) {
+    struct grow_t *g = &heap->grows[a];
+    if (g->bp == NULL) continue;
+    size_t csize = GET_SIZE(g->bp);
+    // (a block whose size changed isn't ours to cut any more)
+    if (csize == g->bsize) {
+      place(g->bp, adjust_size(g->size));
+      trimmed |= (GET_SIZE(g->bp) != csize);
+    }
+    g->bp = NULL;
+    heap->grow_count--;
+  }
+  return trimmed;
+}
+#endif
+
+// dumb_realloc for a big heap block that stays in the heap. The new payload
+// starts at the same offset into its page as the old one, so everything but
+// the partial pages at either end can be moved by mem_remap instead of
+// memcpy. The old block's pages come back as zero pages
+static void *remap_realloc(void *ptr, size_t size) {
+  size_t page = mem_pagesize();
+  char *bp, *src = ptr;
+  size_t usable = GET_SIZE(ptr) + WSIZE;
+  char *lo = (char *)(((size_t)src + page - 1) & ~(page - 1));
+  char *hi = (char *)(((size_t)src + usable) & ~(page - 1));
+  if ((bp = aligned_block(page, (size_t)src & (page - 1), adjust_size(size))) == NULL)
+    return NULL;
+  #if DEBUG>1
+    fprintf(stderr, "remapping %lx bytes of %p to %p\n", hi - lo, ptr, bp);
+  #endif
+  memcpy(bp, src, lo - src);
+  if (mem_remap(bp + (lo - src), lo, hi - lo) != 0)
+    memcpy(bp + (lo - src), lo, hi - lo);
+  memcpy(bp + (hi - src), hi, src + usable - hi);
+  free_block(ptr);
+  return bp;
+}
+
+// a simple realloc that only allocates new space and copies
+static void *dumb_realloc(void *ptr, size_t size) {
+    void *oldptr = ptr;
+    void *newptr;
+    size_t copySize;
+    
+    newptr = malloc_block(size);
+    if (newptr == NULL)
+      return NULL;
+    copySize = usable_size(oldptr);
+    if (size < copySize)
+      copySize = size;
+    memcpy(newptr, oldptr, copySize);
+    free_block(oldptr);
+    return newptr;
+}
+
+// smart realloc that attempts to leave the block in place if at all possible
+static inline void *realloc_block(void *ptr, size_t size)
+{
+    #if DEBUG>1
+      fprintf(stderr, "reallocing block %p (size %lx) with new size %lx\n", ptr, usable_size(ptr), size);
+    #endif
+    #if SLAB
+      if (IS_SLAB(ptr)) {
+        // stay put as long as we'd land in the same slab class anyway
+        if (size != 0 && size <= SLAB_MAX_SIZE && slab_class_for[(size + ALIGNMENT - 1)/ALIGNMENT] == SLAB_RUN(ptr)->class) {
+          STAT(realloc_in_place);
+          return ptr;
+        }
+        STAT(realloc_move);
+        return dumb_realloc(ptr, size);
+      }
+    #endif
+    // (a mapping that mremap grows in place still counts as a move)
+    if (IS_MMAPPED(ptr)) {
+      STAT(realloc_move);
+      if (size >= MMAP_THRESHOLD || size > MAX_SIZE) {
+        return mremap_block(ptr, size);
+      }
+      // small enough to move back into the heap
+      return dumb_realloc(ptr, size);
+    }
+    if (size >= MMAP_THRESHOLD || size > MAX_SIZE) {
+      // too big to keep pinning heap space, give it a mapping
+      STAT(realloc_move);
+      return dumb_realloc(ptr, size);
+    }
+    size_t asize = adjust_size(size);
+    // what we'd like to grow to (asize plus any slack)
+    size_t rsize = asize;
+    #if REALLOC_SLACK
+      size_t count = 1;
+      if (heap->grow_count > 0 && grow_slot(ptr)->bp == ptr) {
+        struct grow_t *g = grow_slot(ptr);
+        if (g->bsize != GET_SIZE(ptr)) {
+          // resized some other way, or freed and handed out again, since
+          grow_forget(ptr);
+        } else if (size >= g->size && asize <= GET_SIZE(ptr)) {
+          // still growing, but into the slack it got last time
+          g->size = size;
+          STAT(realloc_in_place);
+          return ptr;
+        } else {
+          count = g->count + 1;
+          grow_forget(ptr);
+        }
+      }
+      if (count >= GROW_STREAK && asize >= TCACHE_MAX_SIZE) {
+        // half as much again, as long as that still fits under the mmap line
+        size_t slack = asize / 2;
+        if (size + slack >= MMAP_THRESHOLD) slack = MMAP_THRESHOLD - 1 - size;
+        rsize = asize + (slack & ~(ALIGNMENT-1));
+      }
+    #endif
+    long diff = asize - GET_SIZE(ptr);
+    if (diff <= 0) {
+      // resize in-place by freeing the part after it
+      STAT(realloc_in_place);
+      place(ptr, asize);
+    } else {
+      void *nxt_block = NEXT_BLKP(ptr);
+      if ((!IS_ALLOC(nxt_block)) && (DSIZE + GET_SIZE(nxt_block) >= diff)) {
+          // resize in place with next block
+          STAT(realloc_next);
+          freelist_remove(nxt_block);
+          if (heap->last_block == nxt_block) heap->last_block = ptr;
+          size_t csize = DSIZE + GET_SIZE(nxt_block) + GET_SIZE(ptr);
+          HEADER(ptr) = PACK(csize, 1 | IS_PREV_ALLOC(ptr));
+          place(ptr, (rsize < csize) ? rsize : csize);
       } else {
-        if (ptr == last_block) {
+        if (ptr == heap->last_block) {
           // resize in place by extending the heap
-          ptr = extend_block(size);
+          STAT(realloc_extend);
+          void *bp = extend_block(rsize);
+          ptr = (bp == NULL && rsize > asize) ? extend_block(asize) : bp;
+        } else if (!IS_PREV_ALLOC(ptr) &&
+                   GET_SIZE(PREV_BLKP(ptr)) + DSIZE + GET_SIZE(ptr) +
+                   (IS_ALLOC(nxt_block) ? 0 : DSIZE + GET_SIZE(nxt_block)) >= asize) {
+          // slide down into the previous block (and take the next one too)
+          STAT(realloc_down);
+          ptr = realloc_down(ptr, asize, rsize);
         } else {
-          // use the naive alloc / free as last resort
-          ptr = dumb_realloc(ptr, size);
+          // move it as a last resort (big blocks by remapping their pages)
+          STAT(realloc_move);
+          void *(*move)(void *, size_t) =
+            (GET_SIZE(ptr) >= REMAP_THRESHOLD) ? remap_realloc : dumb_realloc;
+          #if HEAP_CHUNKS
+            // no chunk if the move grows the heap: it would catch the next
+            // small malloc and pin the block again, like one from
+            // extend_block would. (a chunk of 0 after a quiet spell stays 0)
+            size_t chunk = heap->chunk, since_miss = heap->since_miss;
+            heap->chunk = 0;
+            heap->since_miss = CHUNK_WINDOW;
+          #endif
+          void *bp = move(ptr, size + (rsize - asize));
+          ptr = (bp == NULL && rsize > asize) ? move(ptr, size) : bp;
+          #if HEAP_CHUNKS
+            heap->chunk = chunk;
+            heap->since_miss = since_miss;
+          #endif
         }
       }
+      #if REALLOC_SLACK
+        if (ptr != NULL && asize >= TCACHE_MAX_SIZE) grow_note(ptr, size, count);
+      #endif
     }
     #if DEBUG
     if (!mm_check()) {
@@ -434,23 +1857,807 @@ void *mm_realloc(void *ptr, size_t size)
     #if DEBUG>1
     fprintf(stderr, "+realloc returning %p (size=%lx)\n", ptr, GET_SIZE(ptr));
     #endif
-    return ptr;
+    return ptr;
+}
+
+/////////////////////
+// public interface
+////////////////////
+
+/* In the single threaded build these are just the calls above. In the
+ * thread safe build small blocks are first tried against the calling
+ * thread's cache and everything else happens under the heap lock.
+ */
+
+#if THREAD_SAFE
+// sets up arena_region and the arena locks (once per process)
+static void arena_reserve(void) {
+  int i;
+  void *region = MAP_FAILED;
+  if (ARENA_COUNT > 1) {
+    // just address space: pages only get used as the arenas grow into them
+    region = mmap(NULL, (ARENA_COUNT - 1)*ARENA_SPAN, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  // without the region everybody shares arena 0
+  arena_region = (region == MAP_FAILED) ? NULL : region;
+  for (i = 0; i < ARENA_COUNT; i++) {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+    if (i > 0 && arena_region != NULL) {
+      arenas[i].start = arenas[i].brk = arenas[i].fresh = arena_region + (i - 1)*ARENA_SPAN;
+      arenas[i].end = arenas[i].start + ARENA_SPAN;
+    }
+  }
+}
+
+// the arena a block was allocated from (mapped blocks count as arena 0)
+static inline struct arena_t *arena_of(void *bp) {
+  size_t off = (char *)bp - arena_region;
+  if (arena_region != NULL && off < (ARENA_COUNT - 1)*ARENA_SPAN)
+    return &arenas[1 + off/ARENA_SPAN];
+  return &arenas[0];
+}
+
+// makes a (whose lock we just took) the arena heap refers to
+// an arena that hasn't been used since mm_init gets a new heap here
+static inline void enter_arena(struct arena_t *a) {
+  arena = a;
+  if ((heap = a->heap) == NULL) {
+    #if SLAB
+      // leave room for the slab map at the bottom of the slice
+      a->brk = a->start + ALIGN(ARENA_SPAN/SLAB_RUN_SIZE/CHAR_BIT);
+    #else
+      a->brk = a->start;
+    #endif
+    init_heap();
+    a->heap = heap;
+  }
+  if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL) {
+    // take the whole list in one go, frees pushed after this wait for next time
+    void *bp = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    while (bp != NULL) {
+      void *next = *(void **)bp;
+      free_block(bp);
+      bp = next;
+    }
+  }
+}
+
+// hands bp back to arena a without taking its lock (one CAS)
+static inline void remote_free(struct arena_t *a, void *bp) {
+  void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+  do {
+    *(void **)bp = head;
+  } while (!__atomic_compare_exchange_n(&a->remote, &head, bp, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static inline void lock_arena(struct arena_t *a) {
+  pthread_mutex_lock(&a->lock);
+  enter_arena(a);
+}
+
+// locks the arena this thread mallocs from. a thread starts out in the
+// arena of the cpu it's on and moves along if it finds that one busy
+static inline void lock_my_arena(void) {
+  struct arena_t *a = my_arena;
+  unsigned int count = (arena_region != NULL) ? ARENA_COUNT : 1;
+  if (a == NULL) {
+    int cpu = sched_getcpu();
+    if (cpu < 0) cpu = __sync_fetch_and_add(&arena_next, 1);
+    a = &arenas[cpu % count];
+  } else if (pthread_mutex_trylock(&a->lock) == 0) {
+    enter_arena(a);
+    return;
+  } else {
+    a = &arenas[__sync_fetch_and_add(&arena_next, 1) % count];
+  }
+  lock_arena(my_arena = a);
+}
+
+// locks the arena bp belongs to, unless *held already is that arena.
+// lets a batch of frees only relock when the arena changes
+static inline void switch_arena(struct arena_t **held, void *bp) {
+  struct arena_t *a = arena_of(bp);
+  if (a == *held) return;
+  if (*held != NULL) pthread_mutex_unlock(&(*held)->lock);
+  lock_arena(*held = a);
+}
+
+// gives every block in the cache back to the arena it came from
+static void tcache_flush(struct tcache_t *tc) {
+  int c;
+  struct arena_t *held = NULL;
+  if (tc->generation != heap_generation) {
+    // the blocks belong to a heap that no longer exists
+    memset(tc, 0, sizeof(struct tcache_t));
+    return;
+  }
+  for (c = 0; c < TCACHE_BINS; c++) {
+    while (tc->blocks[c] != NULL) {
+      void *bp = tc->blocks[c];
+      tc->blocks[c] = *(void **)bp;
+      switch_arena(&held, bp);
+      free_block(bp);
+    }
+    tc->counts[c] = 0;
+  }
+  if (held != NULL) UNLOCK_HEAP();
+}
+
+// run by pthreads when a thread that used its cache exits
+static void tcache_destructor(void *tc) {
+  tcache_flush((struct tcache_t *)tc);
+}
+
+static void tcache_make_key(void) {
+  pthread_key_create(&tcache_key, tcache_destructor);
+}
+
+// makes sure this thread's cache belongs to the current heap
+static inline void tcache_check(void) {
+  if (tcache.generation != heap_generation) {
+    if (tcache.generation == 0) {
+      pthread_once(&tcache_once, tcache_make_key);
+      pthread_setspecific(tcache_key, &tcache);
+    }
+    memset(&tcache, 0, sizeof(struct tcache_t));
+    tcache.generation = heap_generation;
+  }
+}
+
+// the cache stack a malloc of size is served from (0 if it's too big)
+// NOTE: rounding up here and down in mm_free means every block
+//       in stack c is big enough for any request that maps to c
+static inline size_t tcache_class(size_t size) {
+  size_t usable = adjust_size(size) + WSIZE;
+  #if SLAB
+    if (size <= SLAB_MAX_SIZE) {
+      usable = slab_sizes[slab_class_for[(size + ALIGNMENT - 1)/ALIGNMENT]];
+    }
+  #endif
+  if (size == 0 || usable > TCACHE_MAX_SIZE) return 0;
+  return (usable + ALIGNMENT - 1) / ALIGNMENT;
+}
+
+static inline void tcache_push(size_t c, void *bp) {
+  *(void **)bp = tcache.blocks[c];
+  tcache.blocks[c] = bp;
+  tcache.counts[c]++;
+}
+
+static inline void *tcache_pop(size_t c) {
+  void *bp = tcache.blocks[c];
+  tcache.blocks[c] = *(void **)bp;
+  tcache.counts[c]--;
+  return bp;
+}
+
+// frees bp into cache stack c (bp holds at least c*ALIGNMENT bytes)
+static inline void tcache_free(size_t c, void *bp) {
+  tcache_check();
+  if (tcache.counts[c] >= TCACHE_COUNT) {
+    // spill half of them back to their tries in one go
+    struct arena_t *held = NULL;
+    while (tcache.counts[c] > TCACHE_COUNT/2) {
+      void *spill = tcache_pop(c);
+      if (arena_of(spill) != my_arena) {
+        remote_free(arena_of(spill), spill);
+        continue;
+      }
+      switch_arena(&held, spill);
+      free_block(spill);
+    }
+    if (held != NULL) UNLOCK_HEAP();
+  }
+  tcache_push(c, bp);
+}
+#endif
+
+int mm_init(void)
+{
+  int ret;
+  #if THREAD_SAFE
+    int i;
+    pthread_once(&arena_once, arena_reserve);
+    // throw every arena away, the others get a new heap when next used
+    for (i = 0; i < ARENA_COUNT; i++) {
+      pthread_mutex_lock(&arenas[i].lock);
+      if (i > 0 && arenas[i].heap != NULL) {
+        madvise(arenas[i].start, arenas[i].fresh - arenas[i].start, MADV_DONTNEED);
+        arenas[i].fresh = arenas[i].start;
+        arenas[i].heap = NULL;
+      }
+      arenas[i].remote = NULL;
+      pthread_mutex_unlock(&arenas[i].lock);
+    }
+    heap_generation++;
+    // whoever sets the heap up keeps using memlib's heap
+    my_arena = &arenas[0];
+    pthread_mutex_lock(&arenas[0].lock);
+    arena = &arenas[0];
+  #endif
+  #if STATS && THREAD_SAFE
+    memset(stat_shards, 0, sizeof(stat_shards));
+  #elif STATS
+    memset(&stat_counts, 0, sizeof(stat_counts));
+  #endif
+  #if PROFILE
+    profile_reset();
+  #endif
+  ret = init_heap();
+  #if THREAD_SAFE
+    arenas[0].heap = (ret == 0) ? heap : NULL;
+  #endif
+  UNLOCK_HEAP();
+  return ret;
+}
+
+void *mm_malloc(size_t size)
+{
+  #if THREAD_SAFE
+    void *bp;
+    size_t asize = adjust_size(size);
+    size_t c = tcache_class(size);
+    if (c != 0) {
+      tcache_check();
+      if (tcache.blocks[c] != NULL) {
+        return NOTE_MALLOC(tcache_pop(c), size);
+      }
+      // refill: while we hold the lock take a few more exact fits
+      // from the trie so the next mallocs of this size don't need it
+      LOCK_HEAP();
+      bp = malloc_block(size);
+      if (bp != NULL) {
+        void *extra;
+        #if SLAB
+          // slab slots are cheap to hand out in bulk
+          if (size <= SLAB_MAX_SIZE) {
+            while (tcache.counts[c] < TCACHE_COUNT/2 &&
+                   (extra = slab_malloc(size)) != NULL) {
+              tcache_push(c, extra);
+            }
+          } else
+        #endif
+        while ((asize + WSIZE)/ALIGNMENT == c && tcache.counts[c] < TCACHE_COUNT/2 &&
+               (extra = freelist_bestfit(asize)) != NULL &&
+               GET_SIZE(extra) == asize) {
+          freelist_remove(extra);
+          place(extra, asize);
+          tcache_push(c, extra);
+        }
+      }
+      UNLOCK_HEAP();
+      return NOTE_MALLOC(bp, size);
+    }
+    LOCK_HEAP();
+    bp = malloc_block(size);
+    UNLOCK_HEAP();
+    return NOTE_MALLOC(bp, size);
+  #else
+    return NOTE_MALLOC(malloc_block(size), size);
+  #endif
+}
+
+void mm_free(void *bp)
+{
+  NOTE_FREE(bp);
+  #if THREAD_SAFE
+    // enough to look at bp's slab map without taking the lock
+    heap = arena_of(bp)->heap;
+    size_t size = usable_size(bp);
+    if (size <= TCACHE_MAX_SIZE) {
+      tcache_free(size / ALIGNMENT, bp);
+      return;
+    }
+    // (slab slots never get here, they're all small enough for the cache)
+    if (arena_of(bp) != my_arena && !IS_MMAPPED(bp)) {
+      // somebody else's block, let them deal with it next time they lock
+      remote_free(arena_of(bp), bp);
+      return;
+    }
+  #endif
+  LOCK_HEAP_OF(bp);
+  free_block(bp);
+  UNLOCK_HEAP();
+}
+
+void mm_free_sized(void *bp, size_t size)
+{
+  #if THREAD_SAFE
+    heap = arena_of(bp)->heap;
+  #endif
+  #if DEBUG
+    if (!sized_right(bp, size)) {
+      fprintf(stderr, "!! mm_free_sized(%p, %lx) but the block holds %lx\n", bp, size, usable_size(bp));
+    }
+  #endif
+  if (size >= MMAP_THRESHOLD || size > MAX_SIZE) {
+    // a mapping, the munmap costs far more than a look at the header
+    mm_free(bp);
+    return;
+  }
+  NOTE_FREE(bp);
+  // the least the block can hold, worked out without touching its header
+  size_t usable = adjust_size(size) + WSIZE;
+  #if SLAB
+    // (a small request can still have a heap block if slab_malloc failed)
+    int slab = (size <= SLAB_MAX_SIZE && IS_SLAB(bp));
+    if (slab) {
+      usable = slab_sizes[slab_class_for[(size + ALIGNMENT - 1)/ALIGNMENT]];
+    }
+  #endif
+  #if THREAD_SAFE
+    if (usable <= TCACHE_MAX_SIZE) {
+      tcache_free(usable / ALIGNMENT, bp);
+      return;
+    }
+    if (arena_of(bp) != my_arena) {
+      remote_free(arena_of(bp), bp);
+      return;
+    }
+  #endif
+  // start pulling in bp's header and the next block's (which is right after
+  // the usable bytes, unless bp got handed out bigger than asked) while we
+  // take the lock, coalesce needs both
+  __builtin_prefetch((char *)bp - WSIZE, 1);
+  __builtin_prefetch((char *)bp + usable, 1);
+  LOCK_HEAP_OF(bp);
+  #if SLAB
+    if (slab)
+      slab_free(bp);
+    else
+  #endif
+  free_heap_block(bp);
+  UNLOCK_HEAP();
+}
+
+void *mm_realloc(void *ptr, size_t size)
+{
+  void *bp;
+  #if STATS || PROFILE
+    size_t old = note_usable(ptr);
+  #endif
+  // a block stays in (or moves within) the arena it came from
+  if (ptr == NULL) {
+    LOCK_HEAP();
+  } else {
+    LOCK_HEAP_OF(ptr);
+  }
+  bp = realloc_block(ptr, size);
+  UNLOCK_HEAP();
+  #if STATS
+    // (if it failed ptr is still the caller's)
+    if (bp != NULL) STAT_ADD(live_bytes, note_usable(bp) - old);
+  #endif
+  #if PROFILE
+    if (bp != NULL) profile_realloc(ptr, bp, old, size);
+  #endif
+  return bp;
+}
+
+void *mm_calloc(size_t nmemb, size_t size)
+{
+  void *bp;
+  if (size != 0 && nmemb > ((size_t)-1)/size)
+    return NULL;
+  size *= nmemb;
+  #if THREAD_SAFE
+    if (size <= TCACHE_MAX_SIZE) {
+      // small enough to come out of the cache, which is never fresh memory
+      if ((bp = mm_malloc(size)) != NULL)
+        memset(bp, 0, size);
+      return bp;
+    }
+  #endif
+  LOCK_HEAP();
+  bp = calloc_block(size);
+  UNLOCK_HEAP();
+  return NOTE_MALLOC(bp, size);
+}
+
+void *mm_memalign(size_t align, size_t size)
+{
+  void *bp;
+  if (align == 0 || (align & (align - 1)) != 0)
+    return NULL;
+  #if THREAD_SAFE
+    if (align <= ALIGNMENT)
+      return mm_malloc(size);
+  #endif
+  LOCK_HEAP();
+  bp = memalign_block(align, size);
+  UNLOCK_HEAP();
+  return NOTE_MALLOC(bp, size);
+}
+
+int mm_posix_memalign(void **memptr, size_t align, size_t size)
+{
+  void *bp;
+  if (align < sizeof(void *) || (align & (align - 1)) != 0)
+    return EINVAL;
+  if (size == 0) {
+    *memptr = NULL;
+    return 0;
+  }
+  if ((bp = mm_memalign(align, size)) == NULL)
+    return ENOMEM;
+  *memptr = bp;
+  return 0;
+}
+
+size_t mm_malloc_batch(size_t n, const size_t *sizes, void **ptrs)
+{
+  size_t i, got = 0;
+  #if THREAD_SAFE
+    // whatever the thread cache has doesn't need the lock at all
+    tcache_check();
+    for (i = 0; i < n; i++) {
+      size_t c = tcache_class(sizes[i]);
+      ptrs[i] = NULL;
+      if (c != 0 && tcache.blocks[c] != NULL) {
+        ptrs[i] = tcache_pop(c);
+        got++;
+      }
+    }
+    if (got < n)
+  #else
+    for (i = 0; i < n; i++) {
+      ptrs[i] = NULL;
+    }
+  #endif
+  {
+    LOCK_HEAP();
+    got += malloc_blocks(n, sizes, ptrs);
+    UNLOCK_HEAP();
+  }
+  #if STATS || PROFILE
+    for (i = 0; i < n; i++) {
+      NOTE_MALLOC(ptrs[i], sizes[i]);
+    }
+  #endif
+  return got;
+}
+
+void mm_free_batch(size_t n, void **ptrs)
+{
+  #if STATS || PROFILE
+    size_t k;
+    for (k = 0; k < n; k++) {
+      NOTE_FREE(ptrs[k]);
+    }
+  #endif
+  #if THREAD_SAFE
+    size_t i, start;
+    // small blocks go onto the thread cache while there's room, like mm_free
+    tcache_check();
+    for (i = 0; i < n; i++) {
+      if (ptrs[i] == NULL) continue;
+      heap = arena_of(ptrs[i])->heap;
+      size_t c = usable_size(ptrs[i]) / ALIGNMENT;
+      if (c < TCACHE_BINS && tcache.counts[c] < TCACHE_COUNT) {
+        tcache_push(c, ptrs[i]);
+        ptrs[i] = NULL;
+      }
+    }
+    sort_by_address(n, ptrs);
+    // sorted, so each arena's blocks are next to each other: one lock apiece
+    for (start = 0; start < n && ptrs[start] == NULL; start++) ;
+    for (; start < n; start = i) {
+      struct arena_t *a = arena_of(ptrs[start]);
+      for (i = start + 1; i < n && arena_of(ptrs[i]) == a; i++) ;
+      lock_arena(a);
+      free_blocks(i - start, ptrs + start);
+      UNLOCK_HEAP();
+    }
+  #else
+    sort_by_address(n, ptrs);
+    free_blocks(n, ptrs);
+  #endif
+}
+
+int mm_trim(size_t pad)
+{
+  int ret = 0;
+  #if THREAD_SAFE
+    int i;
+    // our own cached blocks might be what's pinning the top of the heap
+    tcache_check();
+    tcache_flush(&tcache);
+    for (i = 0; i < ARENA_COUNT; i++) {
+      if (arenas[i].heap == NULL) continue;
+      lock_arena(&arenas[i]);
+      #if QUICK_LISTS
+        quick_flush();
+      #endif
+      ret |= trim_heap(pad);
+      UNLOCK_HEAP();
+    }
+  #else
+    #if QUICK_LISTS
+      quick_flush();
+    #endif
+    ret = trim_heap(pad);
+  #endif
+  return ret;
+}
+
+// adds free block bp to the free block numbers of stats
+static inline void stats_free_block(void *bp, struct mm_stats *stats) {
+  size_t size = GET_SIZE(bp);
+  stats->free_blocks++;
+  stats->free_bytes[(BITNESS - 1) - __builtin_clzl(size)] += size;
+}
+
+#if !TLSF
+// adds the trie under l (and the stack at each node) to stats
+static void stats_trie(link_t l, struct mm_stats *stats) {
+  struct freenode_t *node, *n;
+  if (l == NIL) return;
+  node = NODE(l);
+  stats->free_nodes++;
+  for (n = node; ; n = NODE(n->next)) {
+    stats_free_block(n, stats);
+    if (n->next == NIL) break;
+  }
+  stats_trie(node->children[0], stats);
+  stats_trie(node->children[1], stats);
+}
+#endif
+
+// adds the heap we're working on to stats (the heap lock must be held)
+static void stats_heap(struct mm_stats *stats) {
+  int a;
+  stats->heap_bytes += heap_end() - (char *)heap;
+  #if TLSF
+    int sl;
+    for (a = 0; a < FL_COUNT; a++) {
+      for (sl = 0; sl < SL_COUNT; sl++) {
+        link_t l = heap->tlsf->lists[a][sl];
+        if (l != NIL) stats->free_nodes++;
+        for (; l != NIL; l = NODE(l)->next) {
+          stats_free_block(NODE(l), stats);
+        }
+      }
+    }
+  #else
+    for (a = 0; a < BIT_COUNT; a++) {
+      stats_trie(heap->bins[a], stats);
+    }
+  #endif
+}
+
+void mm_stats(struct mm_stats *stats)
+{
+  memset(stats, 0, sizeof(struct mm_stats));
+  #if THREAD_SAFE
+    int i;
+    for (i = 0; i < ARENA_COUNT; i++) {
+      if (arenas[i].heap == NULL) continue;
+      lock_arena(&arenas[i]);
+      stats_heap(stats);
+      UNLOCK_HEAP();
+    }
+  #else
+    stats_heap(stats);
+  #endif
+  #if STATS && THREAD_SAFE
+    // (every count is a size_t, and live_bytes only adds up across them)
+    size_t k, *sum = (size_t *)&stats->counts;
+    for (i = 0; i < STATS_SHARDS; i++) {
+      size_t *shard = (size_t *)&stat_shards[i].counts;
+      for (k = 0; k < sizeof(struct mm_counts)/sizeof(size_t); k++) {
+        sum[k] += __atomic_load_n(&shard[k], __ATOMIC_RELAXED);
+      }
+    }
+  #elif STATS
+    stats->counts = stat_counts;
+  #endif
+}
+
+void mm_profile(size_t rate)
+{
+  #if PROFILE
+    profile_set_rate(rate);
+  #endif
+}
+
+void mm_profile_dump(int fd)
+{
+  #if PROFILE
+    profile_dump(fd);
+  #else
+    dprintf(fd, "heap profile: mm.c was built without PROFILE\n");
+  #endif
+}
+
+// writes a row per block of the heap we're working on (arena a) to out
+// (the heap lock must be held)
+static void layout_heap(FILE *out, int a) {
+  void *bp;
+  for (bp = &(heap->head[1]); GET_SIZE(bp)>0; bp = NEXT_BLKP(bp)) {
+    long bin = -1;
+    unsigned int slot_size = 0, slots_used = 0;
+    if (!IS_ALLOC(bp)) {
+      bin = freelist_bin(GET_SIZE(bp));
+    }
+    #if SLAB
+      else if (IS_SLAB(bp)) {
+        struct slab_run_t *run = bp;
+        slot_size = run->slot_size;
+        slots_used = run->nslots - run->nfree;
+      }
+    #endif
+    fprintf(out, "%d,%lu,%lu,%d,%ld,%u,%u\n", a,
+            (unsigned long)((char *)bp - (char *)heap), GET_SIZE(bp),
+            IS_ALLOC(bp) != 0, bin, slot_size, slots_used);
+  }
+}
+
+void mm_dump_layout(int fd)
+{
+  // a heap has a lot more blocks than we want write calls, so go through
+  // stdio (on a dup so fclose leaves fd open)
+  int dupfd = dup(fd);
+  FILE *out;
+  if (dupfd < 0) return;
+  if ((out = fdopen(dupfd, "w")) == NULL) {
+    close(dupfd);
+    return;
+  }
+  fprintf(out, "arena,offset,size,alloc,bin,slot_size,slots_used\n");
+  #if THREAD_SAFE
+    int i;
+    for (i = 0; i < ARENA_COUNT; i++) {
+      if (arenas[i].heap == NULL) continue;
+      lock_arena(&arenas[i]);
+      layout_heap(out, i);
+      UNLOCK_HEAP();
+    }
+  #else
+    layout_heap(out, 0);
+  #endif
+  fclose(out);
+}
+
+// what mdriver -m knows us by
+const mm_backend_t mm_backend = {
+  #if TLSF
+    "tlsf",
+  #else
+    "trie",
+  #endif
+  mm_init, mm_malloc, mm_free, mm_realloc, mm_calloc,
+  mm_malloc_batch, mm_free_batch,
+  mm_stats, // without STATS only the heap and free space numbers are filled in
+  mm_dump_layout,
+  #if PROFILE
+    mm_profile, mm_profile_dump
+  #else
+    NULL, NULL // nothing would ever get sampled
+  #endif
+};
+
+/////////////////////
+// freelist code
+////////////////////
+
+/* Note: No coalescing etc needs to happen here, nor checking of free bit
+ *
+ */
+
+// zero indexed from most significant bit bit-accessor 
+#define BIT_N(s,n) ((((size_t)(s))>>((BITNESS - 1) - (n))) & ((size_t)(1)))
+// safely sets a freenode link and its back pointer
+#define SAFE_SET(dest, source) if (((dest) = (source))!=NIL) NODE(dest)->prev = SLOT_OF(&(dest))
+
+#if TLSF
+// the list that a free block of size belongs in
+static inline void tlsf_mapping(size_t size, size_t *fl, size_t *sl) {
+  if (size < ((size_t)1 << FL_SHIFT)) {
+    *fl = 0;
+    *sl = size >> __builtin_ctzl(ALIGNMENT);
+  } else {
+    size_t log2 = (BITNESS - 1) - __builtin_clzl(size);
+    *sl = (size >> (log2 - TLSF_SL_BITS)) ^ SL_COUNT;
+    *fl = log2 - FL_SHIFT + 1;
+  }
+}
+
+// the list a free block of asize is on, as one number (fl*SL_COUNT + sl)
+static inline long freelist_bin(size_t asize) {
+  size_t fl, sl;
+  tlsf_mapping(asize, &fl, &sl);
+  return fl*SL_COUNT + sl;
+}
+
+// the smallest size that goes in list fl, sl
+#define TLSF_LIST_MIN(fl, sl) ((fl) == 0 ? (size_t)(sl) << __builtin_ctzl(ALIGNMENT) : \
+          (size_t)(SL_COUNT | (sl)) << ((fl) + FL_SHIFT - 1 - TLSF_SL_BITS))
+
+static void *freelist_add(void *bp) {
+  #if DEBUG>1
+    fprintf(stderr, "adding node %p (size=%lx) to the lists\n", bp, GET_SIZE(bp));
+  #endif
+  size_t asize = GET_SIZE(bp);
+  if (asize > MAX_SIZE) {
+    #if DEBUG
+    fprintf(stderr, "!! attempting to add block size %lx > %lx to freelist!\n", asize, MAX_SIZE);
+    #endif
+    return NULL;
+  }
+  size_t fl, sl;
+  tlsf_mapping(asize, &fl, &sl);
+  struct tlsf_t *t = heap->tlsf;
+  struct freenode_t *node = (struct freenode_t *)bp;
+  link_t *list = &t->lists[fl][sl];
+  #if ADDRESS_ORDER
+    while (*list != NIL && NODE(*list) < node) {
+      list = &(NODE(*list)->next);
+    }
+  #endif
+  node->prev = SLOT_OF(list);
+  SAFE_SET(node->next, *list);
+  *list = LINK(node);
+  t->sl_map[fl] |= 1U << sl;
+  t->fl_map |= ((size_t)1) << fl;
+  return bp;
 }
 
-/////////////////////
-// freelist code
-////////////////////
+static void freelist_remove(void *bp) {
+  #if DEBUG>1
+    fprintf(stderr, "removing node %p (size=%lx) from the lists\n", bp, GET_SIZE(bp));
+  #endif
+  struct freenode_t *node = (struct freenode_t *)bp;
+  link_t *slot = SLOT(node->prev);
+  if ((*slot = node->next) != NIL) {
+    NODE(node->next)->prev = node->prev;
+  } else {
+    // was it the only block in its list?
+    size_t fl, sl;
+    tlsf_mapping(GET_SIZE(node), &fl, &sl);
+    struct tlsf_t *t = heap->tlsf;
+    if (slot == &t->lists[fl][sl] && (t->sl_map[fl] &= ~(1U << sl)) == 0) {
+      t->fl_map &= ~(((size_t)1) << fl);
+    }
+  }
+}
 
-/* Note: No coalescing etc needs to happen here, nor checking of free bit
- *
- */
+// the first block of the first non-empty list whose blocks all hold sz, or
+// the block at the top of sz's own list if that one happens to be big enough
+static void *freelist_bestfit(size_t sz) {
+  struct tlsf_t *t = heap->tlsf;
+  size_t fl, sl;
+  tlsf_mapping(sz, &fl, &sl);
+  link_t first = t->lists[fl][sl];
+  if (first != NIL && GET_SIZE(NODE(first)) >= sz) {
+    return NODE(first);
+  }
+  // round sz up to the next list boundary (a no-op in first level 0)
+  if (fl > 0 && sz != TLSF_LIST_MIN(fl, sl) && ++sl == SL_COUNT) {
+    sl = 0;
+    fl++;
+  }
+  size_t sl_map = (fl < FL_COUNT) ? t->sl_map[fl] & (~0U << sl) : 0;
+  if (sl_map == 0) {
+    size_t fl_map = (fl + 1 < FL_COUNT) ? t->fl_map & (~(size_t)0 << (fl + 1)) : 0;
+    if (fl_map == 0) {
+      // guess we got nothing for you
+      return NULL;
+    }
+    fl = __builtin_ctzl(fl_map);
+    sl_map = t->sl_map[fl];
+  }
+  return NODE(t->lists[fl][__builtin_ctzl(sl_map)]);
+}
 
-// zero indexed from most significant bit bit-accessor 
-#define BIT_N(s,n) ((((size_t)(s))>>((BITNESS - 1) - (n))) & ((size_t)(1)))
+#else
 // Gets the bin number for a size: note larger sizes -> smaller bin number
 #define BIN_FOR(asize) ((__builtin_clzl(asize))-BIT_OFFSET)
-// safely sets a freenode pointer and its back pointer
-#define SAFE_SET(dest, source) if (((dest) = (source))!=NULL) (dest)->prev = &(dest)
+// the bin a free block of asize is in
+static inline long freelist_bin(size_t asize) {
+  return BIN_FOR(asize);
+}
 // copies the child pointers from source to dest
 #define SET_CHILDREN(dest, source) \
           SAFE_SET((dest)->children[0], (source)->children[0]); \
@@ -461,17 +2668,17 @@ void *mm_realloc(void *ptr, size_t size)
 // finds the rightmost leaf of the trie
 // NOTE: rightmost is more efficient than leftmost in trials
 static struct freenode_t * get_leaf(struct freenode_t * n) {
-  do {
-    if (n->children[1] != NULL) {
-      n = n->children[1];
+  while (TRUE) {
+    if (n->children[1] != NIL) {
+      n = NODE(n->children[1]);
       continue;
     }
-    if (n->children[0] != NULL) {
-      n = n->children[0];
+    if (n->children[0] != NIL) {
+      n = NODE(n->children[0]);
       continue;
     }
-  } while (FALSE);
-  return n;
+    return n;
+  }
 }
 
 static void *freelist_add(void *bp) {
@@ -486,31 +2693,47 @@ static void *freelist_add(void *bp) {
     return NULL;
   }
   size_t bit = BIN_FOR(asize);
-  struct freenode_t ** node_ptr = &(heap->bins[bit]); // node has the address of the bin pointer
+  link_t * node_ptr = &(heap->bins[bit]); // node has the address of the bin pointer
+  heap->binmap |= ((size_t)1) << bit;
   bit += BIT_OFFSET;
   struct freenode_t * new_node = (struct freenode_t *)bp;
   while(1) {
-    if (*node_ptr == NULL) {
-      *node_ptr = new_node;
-      new_node->prev = node_ptr;
-      new_node->next = new_node->children[0] = new_node->children[1] = NULL;
+    if (*node_ptr == NIL) {
+      *node_ptr = LINK(new_node);
+      new_node->prev = SLOT_OF(node_ptr);
+      new_node->next = new_node->children[0] = new_node->children[1] = NIL;
       return bp;
     }
-    if (GET_SIZE(*node_ptr) == asize) {
-      new_node->prev = node_ptr;
+    struct freenode_t * node = NODE(*node_ptr);
+    if (GET_SIZE(node) == asize) {
+      #if ADDRESS_ORDER
+      if (node < new_node) {
+        // goes after the last block below it, leaving the top of the stack
+        // (and its children) where they are
+        while (node->next != NIL && NODE(node->next) < new_node) {
+          node = NODE(node->next);
+        }
+        new_node->prev = SLOT_OF(&(node->next));
+        SAFE_SET(new_node->next, node->next);
+        node->next = LINK(new_node);
+        new_node->children[0] = new_node->children[1] = NIL;
+        return bp;
+      }
+      #endif
+      new_node->prev = SLOT_OF(node_ptr);
       new_node->next = *node_ptr;
-      SET_CHILDREN(new_node, *node_ptr);
-      (*node_ptr)->children[0] = NULL;
-      (*node_ptr)->children[1] = NULL;
-      (*node_ptr)->prev = &(new_node->next);
-      *node_ptr = new_node;
+      SET_CHILDREN(new_node, node);
+      node->children[0] = NIL;
+      node->children[1] = NIL;
+      node->prev = SLOT_OF(&(new_node->next));
+      *node_ptr = LINK(new_node);
       return bp;
     }
     ++bit;
     #if DEBUG>1
     fprintf(stderr, "bit=%lu, size=%lx, bit_n=%lu\n", bit, asize, BIT_N(asize,bit));
     #endif
-    node_ptr = &((*node_ptr)->children[BIT_N(asize,bit)]);
+    node_ptr = &(node->children[BIT_N(asize,bit)]);
     #if DEBUG
       if (bit > 64) {
         fprintf(stderr, "!! Infinite loop in freelist_add!\n");
@@ -526,31 +2749,37 @@ static void freelist_remove(void *bp) {
   #endif
   struct freenode_t * node = (struct freenode_t *)bp;
   // if part of LL
-  if (node->next != NULL) {
-    node->next->prev = node->prev;
-    *(node->prev) = node->next;
-    SET_CHILDREN(node->next, node);
+  if (node->next != NIL) {
+    struct freenode_t * next = NODE(node->next);
+    next->prev = node->prev;
+    *SLOT(node->prev) = node->next;
+    SET_CHILDREN(next, node);
     return;
   }
   struct freenode_t * descendant = get_leaf(node);
   if (descendant == node) {
-    *(node->prev) = NULL;
+    link_t *slot = SLOT(node->prev);
+    *slot = NIL;
+    // a childless root leaves its bin empty
+    if (slot >= heap->bins && slot < heap->bins + BIT_COUNT) {
+      heap->binmap &= ~(((size_t)1) << (slot - heap->bins));
+    }
   } else {
-    *(descendant->prev) = NULL;
+    *SLOT(descendant->prev) = NIL;
     SET_CHILDREN(descendant, node);
     descendant->prev = node->prev;
-    *(node->prev) = descendant;
+    *SLOT(node->prev) = LINK(descendant);
   }
 }
 
 static void *smallest_ancestor(struct freenode_t *node) {
   struct freenode_t *smallest = node;
   while (1) {
-    if (node->children[0] != NULL) {
-      node = node->children[0];
+    if (node->children[0] != NIL) {
+      node = NODE(node->children[0]);
     } else {
-      if (node->children[1] != NULL) {
-        node = node->children[1];
+      if (node->children[1] != NIL) {
+        node = NODE(node->children[1]);
       } else {
         break;
       }
@@ -565,9 +2794,10 @@ static void *smallest_ancestor(struct freenode_t *node) {
 static void *freelist_bestfit(size_t sz) {
   struct freenode_t * bestfit = NULL;
   size_t bit = BIN_FOR(sz);
-  struct freenode_t * node = heap->bins[bit]; // node has the address of the bin pointer
+  link_t link = heap->bins[bit];
   // try the correct bin first
-  while (node) {
+  while (link != NIL) {
+    struct freenode_t * node = NODE(link);
     #if DEBUG
       if (bit > LSIG_BIT_OF_SIZE) {
         fprintf(stderr, "!! bestfit went beyond normal trie depth!\n");
@@ -584,36 +2814,433 @@ static void *freelist_bestfit(size_t sz) {
       }
     }
     ++bit;
-    node = node->children[BIT_N(sz,bit)];
+    link = node->children[BIT_N(sz,bit)];
   }
   if (bestfit != NULL) {
     return bestfit;
   }
-  // if that doesn't work find anything larger
-  for (bit = BIN_FOR(sz)-1; bit > 0; bit--) {
-    node = heap->bins[bit];
-    if (node != NULL) {
-      return smallest_ancestor(node);
+  // if that doesn't work find anything larger:
+  // the nearest non-empty bin before ours (bins before hold larger sizes)
+  size_t larger = heap->binmap & ((((size_t)1) << BIN_FOR(sz)) - 1);
+  if (larger == 0) {
+    // guess we got nothing for you
+    return NULL;
+  }
+  bit = (BITNESS - 1) - __builtin_clzl(larger);
+  return smallest_ancestor(NODE(heap->bins[bit]));
+}
+
+#endif
+
+// a free block with room for sz bytes skew past an align boundary. Any block
+// of sz + align + MIN_SIZE + DSIZE will do, but a smaller one may happen to
+// line up: so first walk up through the sizes from sz (and the stack of
+// blocks of each size), giving up after ALIGNED_FIT_TRIES blocks
+static void *freelist_alignedfit(size_t align, size_t skew, size_t sz) {
+  size_t sure = sz + align + MIN_SIZE + DSIZE;
+  size_t s = sz;
+  int tries = ALIGNED_FIT_TRIES;
+  struct freenode_t *node;
+  while (tries > 0 && s < sure && (node = freelist_bestfit(s)) != NULL) {
+    s = GET_SIZE(node);
+    while (1) {
+      if (aligned_fits((char *)node, align, skew, sz)) {
+        return node;
+      }
+      if (--tries == 0 || node->next == NIL) break;
+      node = NODE(node->next);
+    }
+    s += ALIGNMENT;
+  }
+  return freelist_bestfit(sure);
+}
+
+
+/////////////////////
+// slab code
+////////////////////
+
+#if SLAB
+// gives a new heap the run map (with room for runs runs) starting at
+// the heap and builds the size -> class table the first time through
+static void slab_init(unsigned long *map, size_t runs) {
+  size_t s, c = 0;
+  heap->slab_map = map;
+  heap->slab_map_base = ((size_t)heap)/SLAB_RUN_SIZE;
+  heap->slab_map_top = 0;
+  heap->slab_map_runs = runs;
+  // the table is the same for every heap (and other arenas may be reading it)
+  if (slab_class_for[SLAB_MAX_SIZE/ALIGNMENT] != 0) return;
+  for (s = 0; s <= SLAB_MAX_SIZE/ALIGNMENT; s++) {
+    while (slab_sizes[c] < s*ALIGNMENT) c++;
+    slab_class_for[s] = c;
+  }
+}
+
+static inline void slab_push(struct slab_run_t *run) {
+  struct slab_run_t **head = &(heap->slabs[run->class]);
+  if ((run->next = *head) != NULL) run->next->prev = &(run->next);
+  run->prev = head;
+  *head = run;
+}
+
+static inline void slab_unlink(struct slab_run_t *run) {
+  if ((*(run->prev) = run->next) != NULL) run->next->prev = run->prev;
+}
+
+// carves a new run for class c out of the heap
+// NOTE: the run block is exactly SLAB_RUN_SIZE including its header / footer
+//       so runs made one after another at the end of the heap pack perfectly
+static struct slab_run_t *slab_new_run(size_t c) {
+  struct slab_run_t *run = aligned_block(SLAB_RUN_SIZE, 0, SLAB_RUN_SIZE - DSIZE);
+  size_t n, i;
+  if (run == NULL)
+    return NULL;
+  n = SLAB_MAP_INDEX(run);
+  if (n >= heap->slab_map_runs) {
+    // beyond what the map covers, let the trie have it
+    free_block(run);
+    return NULL;
+  }
+  #if DEBUG>1
+    fprintf(stderr, "new slab run %p for slot size %u\n", run, slab_sizes[c]);
+  #endif
+  if (n >= heap->slab_map_top) {
+    // the map isn't cleared by slab_init, so bits past the top may
+    // be left over from an older heap
+    size_t w = heap->slab_map_top/BITNESS;
+    if (heap->slab_map_top % BITNESS)
+      heap->slab_map[w++] &= (1UL << (heap->slab_map_top % BITNESS)) - 1;
+    if (w <= n/BITNESS)
+      memset(&heap->slab_map[w], 0, (n/BITNESS + 1 - w)*sizeof(unsigned long));
+    heap->slab_map_top = n + 1;
+  }
+  heap->slab_map[n/BITNESS] |= 1UL << (n%BITNESS);
+  run->class = c;
+  run->slot_size = slab_sizes[c];
+  run->nslots = run->nfree = (SLAB_RUN_SIZE - WSIZE - SLAB_FIRST_SLOT)/run->slot_size;
+  memset(run->freemap, 0, sizeof(run->freemap));
+  for (i = 0; i < run->nslots/BITNESS; i++) {
+    run->freemap[i] = ~0UL;
+  }
+  if (run->nslots % BITNESS) {
+    run->freemap[i] = (1UL << (run->nslots % BITNESS)) - 1;
+  }
+  slab_push(run);
+  return run;
+}
+
+// hands out the lowest free slot of the first run with room in it
+static void *slab_malloc(size_t size) {
+  size_t c = slab_class_for[(size + ALIGNMENT - 1)/ALIGNMENT];
+  struct slab_run_t *run = heap->slabs[c];
+  size_t w = 0, bit;
+  if (run == NULL && (run = slab_new_run(c)) == NULL)
+    return NULL;
+  while (run->freemap[w] == 0) w++;
+  bit = __builtin_ctzl(run->freemap[w]);
+  run->freemap[w] &= ~(1UL << bit);
+  if (--run->nfree == 0) {
+    // full runs aren't on any list
+    slab_unlink(run);
+  }
+  return (char *)run + SLAB_FIRST_SLOT + (w*BITNESS + bit)*run->slot_size;
+}
+
+static void slab_free(void *p) {
+  struct slab_run_t *run = SLAB_RUN(p);
+  size_t i = ((char *)p - ((char *)run + SLAB_FIRST_SLOT))/run->slot_size;
+  #if DEBUG
+    if ((run->freemap[i/BITNESS] >> (i%BITNESS)) & 1) {
+      fprintf(stderr, "!! slab slot %p freed twice!\n", p);
+      return;
+    }
+  #endif
+  run->freemap[i/BITNESS] |= 1UL << (i%BITNESS);
+  if (run->nfree++ == 0) {
+    slab_push(run);
+  } else if (run->nfree == run->nslots &&
+             (heap->slabs[run->class] != run || run->next != NULL)) {
+    // an empty run goes back to the heap unless it's the last of its class
+    size_t n = SLAB_MAP_INDEX(run);
+    slab_unlink(run);
+    heap->slab_map[n/BITNESS] &= ~(1UL << (n%BITNESS));
+    free_block(run);
+  }
+}
+#endif
+
+/////////////////////
+// profiler code
+////////////////////
+
+#if PROFILE
+/* struct sample_t
+ *
+ * One sampled block that hasn't been freed yet: where it is, how much the
+ * caller asked for, about how many malloced bytes it stands for and the call
+ * stack that malloced it. Live samples are hashed by address into
+ * sample_buckets, unused ones are on sample_free (both through next).
+ */
+struct sample_t
+{
+  void *bp;
+  size_t size;
+  size_t weight;
+  struct sample_t *next;
+  int depth;
+  void *stack[PROFILE_DEPTH];
+};
+
+/* struct sampler_t
+ *
+ * Each thread's countdown to its next sample. The generation says which
+ * profile_rate the countdown was drawn for.
+ */
+struct sampler_t
+{
+  long left;
+  unsigned long generation;
+  unsigned long long seed;
+};
+
+// every group of samples with the same call stack, for mm_profile_dump
+struct sample_group_t
+{
+  struct sample_t **first;
+  size_t count, bytes, weight;
+};
+
+static struct sample_t samples[PROFILE_SAMPLES];
+static struct sample_t *sample_buckets[PROFILE_SAMPLES];
+static struct sample_t *sample_free;
+static size_t sample_count; // how many are live
+static size_t sample_dropped; // samples we had no room for
+// mean bytes between samples (0 is off). Changing it bumps the generation
+static size_t profile_rate;
+static unsigned long profile_generation;
+#if THREAD_SAFE
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct sampler_t sampler;
+#  define LOCK_PROFILE() pthread_mutex_lock(&profile_lock)
+#  define UNLOCK_PROFILE() pthread_mutex_unlock(&profile_lock)
+#else
+static struct sampler_t sampler;
+#  define LOCK_PROFILE()
+#  define UNLOCK_PROFILE()
+#endif
+
+// the bucket of sample_buckets that bp hashes to
+static inline struct sample_t **sample_bucket(void *bp) {
+  return &sample_buckets[(((size_t)bp / ALIGNMENT) ^ ((size_t)bp >> 12)) % PROFILE_SAMPLES];
+}
+
+// forgets every sample (mm_init threw their heap away)
+static void profile_reset(void) {
+  size_t i;
+  LOCK_PROFILE();
+  memset(sample_buckets, 0, sizeof(sample_buckets));
+  sample_free = NULL;
+  for (i = 0; i < PROFILE_SAMPLES; i++) {
+    samples[i].next = sample_free;
+    sample_free = &samples[i];
+  }
+  sample_count = 0;
+  UNLOCK_PROFILE();
+}
+
+static void profile_set_rate(size_t rate) {
+  LOCK_PROFILE();
+  __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&profile_generation, 1, __ATOMIC_RELAXED);
+  UNLOCK_PROFILE();
+}
+
+// bytes until this thread's next sample: exponential with mean rate, so
+// every byte malloced has the same chance of being the one that's sampled
+static long profile_gap(size_t rate) {
+  double u;
+  // xorshift64*
+  sampler.seed ^= sampler.seed >> 12;
+  sampler.seed ^= sampler.seed << 25;
+  sampler.seed ^= sampler.seed >> 27;
+  u = (double)((sampler.seed * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+  return (long)(-log(1.0 - u) * rate) + 1;
+}
+
+// how many malloced bytes a sample of size bytes stands for. The average
+// one stands for rate bytes, but one bigger than the gaps almost always gets
+// sampled and so stands for little more than itself
+static inline size_t sample_weight(size_t size, size_t rate) {
+  return (size_t)(size / (1.0 - exp(-(double)size / rate)));
+}
+
+// records bp (size bytes) with the call stack that got us here, once this
+// thread's countdown has run out
+__attribute__((noinline))
+static void profile_sample(void *bp, size_t size) {
+  size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+  unsigned long generation = __atomic_load_n(&profile_generation, __ATOMIC_RELAXED);
+  void *stack[PROFILE_DEPTH + 1];
+  struct sample_t *s, **bucket;
+  int depth;
+  if (sampler.generation != generation) {
+    // a new thread, or a new rate: start counting down from a fresh gap
+    if (sampler.seed == 0) sampler.seed = ((size_t)&sampler * 2654435761UL) | 1;
+    sampler.generation = generation;
+    sampler.left = profile_gap(rate);
+    return;
+  }
+  sampler.left = profile_gap(rate);
+  // (the first frame is this function)
+  depth = backtrace(stack, PROFILE_DEPTH + 1) - 1;
+  if (depth < 0) depth = 0;
+  LOCK_PROFILE();
+  if ((s = sample_free) == NULL) {
+    sample_dropped++;
+    UNLOCK_PROFILE();
+    return;
+  }
+  sample_free = s->next;
+  s->bp = bp;
+  s->size = size;
+  s->weight = sample_weight(size, rate);
+  s->depth = depth;
+  memcpy(s->stack, stack + 1, depth * sizeof(void *));
+  bucket = sample_bucket(bp);
+  s->next = *bucket;
+  *bucket = s;
+  sample_count++;
+  UNLOCK_PROFILE();
+}
+
+// counts a malloc of size bytes (at bp) against this thread's countdown
+static inline void profile_malloc(void *bp, size_t size) {
+  if (__atomic_load_n(&profile_rate, __ATOMIC_RELAXED) != 0 &&
+      (sampler.left -= (long)size) < 0) {
+    profile_sample(bp, size);
+  }
+}
+
+// drops bp's sample (if it has one)
+static void profile_forget(void *bp) {
+  struct sample_t **p, *s;
+  LOCK_PROFILE();
+  for (p = sample_bucket(bp); (s = *p) != NULL; p = &(s->next)) {
+    if (s->bp == bp) {
+      *p = s->next;
+      s->next = sample_free;
+      sample_free = s;
+      sample_count--;
+      break;
+    }
+  }
+  UNLOCK_PROFILE();
+}
+
+// bp is being freed. Only a block whose bucket isn't empty can have been
+// sampled, so most frees don't need the lock
+static inline void profile_free(void *bp) {
+  if (__atomic_load_n(sample_bucket(bp), __ATOMIC_RELAXED) != NULL) {
+    profile_forget(bp);
+  }
+}
+
+// moves ptr's sample (if it has one) over to bp, which now holds size bytes.
+// returns 1 if there was one
+static int profile_move(void *ptr, void *bp, size_t size) {
+  struct sample_t **p, *s;
+  size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+  LOCK_PROFILE();
+  for (p = sample_bucket(ptr); (s = *p) != NULL; p = &(s->next)) {
+    if (s->bp == ptr) {
+      *p = s->next;
+      s->bp = bp;
+      s->size = size;
+      if (rate != 0) s->weight = sample_weight(size, rate);
+      p = sample_bucket(bp);
+      s->next = *p;
+      *p = s;
+      break;
     }
   }
-  // once more for bit = 0
-  node = heap->bins[bit];
-  if (node != NULL) {
-    return node;
+  UNLOCK_PROFILE();
+  return s != NULL;
+}
+
+// realloc turned ptr (old usable bytes) into bp (size bytes). A sampled block
+// keeps its sample. Any other only counts the bytes it grew by, otherwise a
+// block that keeps growing would get sampled over and over
+static inline void profile_realloc(void *ptr, void *bp, size_t old, size_t size) {
+  if (__atomic_load_n(sample_bucket(ptr), __ATOMIC_RELAXED) != NULL &&
+      profile_move(ptr, bp, size)) {
+    return;
+  }
+  if (size > old && __atomic_load_n(&profile_rate, __ATOMIC_RELAXED) != 0 &&
+      (sampler.left -= (long)(size - old)) < 0) {
+    profile_sample(bp, size);
   }
-  // guess we got nothing for you
-  return NULL;
 }
 
+// qsort orders for profile_dump: samples by call stack, groups most first
+static int stack_order(const void *a, const void *b) {
+  const struct sample_t *x = *(struct sample_t * const *)a;
+  const struct sample_t *y = *(struct sample_t * const *)b;
+  if (x->depth != y->depth) return x->depth - y->depth;
+  return memcmp(x->stack, y->stack, x->depth * sizeof(void *));
+}
+
+static int group_order(const void *a, const void *b) {
+  const struct sample_group_t *x = a, *y = b;
+  return (x->weight < y->weight) - (x->weight > y->weight);
+}
+
+// writes the live samples to fd, one entry per call stack
+static void profile_dump(int fd) {
+  static struct sample_t *sorted[PROFILE_SAMPLES];
+  static struct sample_group_t groups[PROFILE_SAMPLES];
+  size_t i, n = 0, g = 0, bytes = 0, weight = 0;
+  struct sample_t *s;
+  LOCK_PROFILE();
+  for (i = 0; i < PROFILE_SAMPLES; i++) {
+    for (s = sample_buckets[i]; s != NULL; s = s->next) {
+      sorted[n++] = s;
+    }
+  }
+  qsort(sorted, n, sizeof(struct sample_t *), stack_order);
+  for (i = 0; i < n; i++) {
+    if (i == 0 || stack_order(&sorted[i - 1], &sorted[i]) != 0) {
+      groups[g].first = &sorted[i];
+      groups[g].count = groups[g].bytes = groups[g].weight = 0;
+      g++;
+    }
+    groups[g - 1].count++;
+    groups[g - 1].bytes += sorted[i]->size;
+    groups[g - 1].weight += sorted[i]->weight;
+    bytes += sorted[i]->size;
+    weight += sorted[i]->weight;
+  }
+  qsort(groups, g, sizeof(struct sample_group_t), group_order);
+  dprintf(fd, "heap profile: %lu live samples of %lu bytes (about %lu bytes "
+          "live), 1 per %lu bytes malloced, %lu dropped\n",
+          n, bytes, weight, profile_rate, sample_dropped);
+  for (i = 0; i < g; i++) {
+    dprintf(fd, "about %lu bytes live (%lu samples of %lu bytes) from:\n",
+            groups[i].weight, groups[i].count, groups[i].bytes);
+    backtrace_symbols_fd((*groups[i].first)->stack, (*groups[i].first)->depth, fd);
+  }
+  UNLOCK_PROFILE();
+}
+#endif
 
 //////////////////
 // DEBUG ONLY CODE
 //////////////////
 #if DEBUG
 
-int check_bins();
+static int check_bins();
 
-int check_defines(void) {
+static int check_defines(void) {
   int problems = 0;
   if(ALIGN(ALIGNMENT*3 - 1) != ALIGNMENT*3) {
     fprintf(stderr, "!!ALIGN is whack!!\n");
@@ -627,6 +3254,12 @@ int check_defines(void) {
     fprintf(stderr, "!!! BIT_N is whack!!\n");
     problems++;
   }
+  #if COMPACT_NODES && THREAD_SAFE
+    if (ARENA_SPAN > ((size_t)1 << 32)) {
+      fprintf(stderr, "!!! arenas are too big for 32 bit node links!!\n");
+      problems++;
+    }
+  #endif
   if (check_bins()) {
     fprintf(stderr, "!!! THE BINS is whack!!\n");
     problems++;
@@ -634,38 +3267,70 @@ int check_defines(void) {
   return problems;
 }
 
-int check_bins() {
+#if TLSF
+// the smallest size of every list maps to that list, the size just below it
+// to the list before, and MAX_SIZE to a list we have
+static int check_bins() {
+  size_t fl, sl, f, l;
+  for (fl = 0; fl < FL_COUNT; fl++) {
+    for (sl = 0; sl < SL_COUNT; sl++) {
+      size_t lo = TLSF_LIST_MIN(fl, sl);
+      if (lo <= MIN_SIZE || lo > MAX_SIZE) continue;
+      tlsf_mapping(lo, &f, &l);
+      if (f != fl || l != sl) {
+        fprintf(stderr, "!!! size %lx maps to list %lu, %lu not %lu, %lu!\n", lo, f, l, fl, sl);
+        return 1;
+      }
+      tlsf_mapping(lo - ALIGNMENT, &f, &l);
+      if (f*SL_COUNT + l + 1 != fl*SL_COUNT + sl) {
+        fprintf(stderr, "!!! size %lx maps to list %lu, %lu!\n", lo - ALIGNMENT, f, l);
+        return 1;
+      }
+    }
+  }
+  tlsf_mapping(MAX_SIZE, &f, &l);
+  return f >= FL_COUNT;
+}
+#else
+static int check_bins() {
   int s;
   long unsigned c = 0;
   for(s = MAX_SIZE; s >= MIN_SIZE; s = s >> 1) {
     size_t b = BIN_FOR(s);
-    heap->bins[b] = (void *)(c++);
+    heap->bins[b] = (link_t)(c++);
   }
-  struct freenode_t **l = heap->bins;
+  link_t *l = heap->bins;
   for (c = 0; c < BIT_COUNT; c++) {
-    if (l[c] != (void *)(c)) {
+    if (l[c] != (link_t)(c)) {
       fprintf(stderr, "!!! There's a serious bins problem!\n");
       return 1;
     }
   }
-  memset(l, 0, sizeof(struct freenode_t *)*BIT_COUNT);
+  memset(l, 0, sizeof(link_t)*BIT_COUNT);
   return 0;
 }
+#endif
 
-int uncoalesced(void);
-int inconsistant_footer(void);
-int ends_in_epilogue(void);
-int triecrawl(void);
+static int uncoalesced(void);
+static int bad_slabs(void);
+static int bad_quick(void);
+static int inconsistant_footer(void);
+static int ends_in_epilogue(void);
+#if TLSF
+static int listcrawl(void);
+#else
+static int triecrawl(void);
+#endif
 
-extern int err(char * message);
+static int err(char * message);
 
-int err(char * message) {
+static int err(char * message) {
   fprintf(stderr, "%s\n", message);
   return 0;
 }
 
 // returns 0 IFF problem
-int mm_check(void) {
+static int mm_check(void) {
   if(!ends_in_epilogue()) {
     return err("!! The heap doesn't end in an epilogue!");
   }
@@ -675,16 +3340,29 @@ int mm_check(void) {
   if(uncoalesced()) {
     return err("!! Some blocks escaped coalescing!");
   }
-  if(triecrawl()) {
-    exit(1);
-    return err("!!! The trie is messed up!");
+  if(bad_slabs()) {
+    return err("!! Some slab runs have miscounted free slots!");
   }
+  if(bad_quick()) {
+    return err("!! Some quick lists hold the wrong blocks!");
+  }
+  #if TLSF
+    if(listcrawl()) {
+      exit(1);
+      return err("!!! The free lists are messed up!");
+    }
+  #else
+    if(triecrawl()) {
+      exit(1);
+      return err("!!! The trie is messed up!");
+    }
+  #endif
   return 1;
 }
 
-int ends_in_epilogue(void) {
-  size_t *ep = (mem_heap_hi() + 1 - WSIZE);
-  if (*ep != PACK(0,1)) {
+static int ends_in_epilogue(void) {
+  size_t *ep = (size_t *)(heap_end() - WSIZE);
+  if ((*ep & ~PREV_ALLOC) != PACK(0,1)) {
     return 0;
   } else {
     return 1;
@@ -692,7 +3370,7 @@ int ends_in_epilogue(void) {
 }
 
 // returns the number of uncoalesced, neighboring blocks
-int uncoalesced(void) {
+static int uncoalesced(void) {
   void *bp;
   int previous_free = 0;
   int number = 0;
@@ -709,23 +3387,89 @@ int uncoalesced(void) {
   return number;
 }
 
-// returns the number of blocks with inconsistant headers and footers
-int inconsistant_footer(void) {
+// returns the number of blocks on the quick lists that aren't allocated heap
+// blocks of their list's size, plus one if quick_count is off
+static int bad_quick(void) {
+  int number = 0;
+  #if QUICK_LISTS
+    size_t c, count = 0;
+    void *bp;
+    for (c = 0; c <= QUICK_MAX_SIZE/ALIGNMENT; c++) {
+      for (bp = heap->quick[c]; bp != NULL; bp = *(void **)bp, count++) {
+        if (!IS_ALLOC(bp) || GET_SIZE(bp) != c*ALIGNMENT) {
+          fprintf(stderr, "!! %p (header %lx) is on quick list %lu\n", bp, HEADER(bp), c);
+          number++;
+        }
+      }
+    }
+    if (count != heap->quick_count) {
+      fprintf(stderr, "!! the quick lists hold %lu blocks but say %lu\n", count, heap->quick_count);
+      number++;
+    }
+  #endif
+  return number;
+}
+
+// is size something bp could have been malloced with, and does it send
+// mm_free_sized down the same path the header would
+static int sized_right(void *bp, size_t size) {
+  if (size > usable_size(bp)) return 0;
+  #if SLAB
+    if (IS_SLAB(bp)) return size <= SLAB_MAX_SIZE;
+  #endif
+  // (only mm_memalign makes small mapped blocks)
+  return !IS_MMAPPED(bp) || size >= MMAP_THRESHOLD || size > MAX_SIZE;
+}
+
+// returns the number of slab runs (with free slots) whose counts are off
+static int bad_slabs(void) {
+  int number = 0;
+  #if SLAB
+    size_t c, w, nfree;
+    struct slab_run_t *run;
+    for (c = 0; c < SLAB_CLASSES; c++) {
+      for (run = heap->slabs[c]; run != NULL; run = run->next) {
+        nfree = 0;
+        for (w = 0; w < SLAB_MAP_WORDS; w++) {
+          nfree += __builtin_popcountl(run->freemap[w]);
+        }
+        if (nfree != run->nfree || nfree == 0 || run->class != c || !IS_SLAB(run)) {
+          fprintf(stderr, "!! slab run %p has %lu free slots but says %u\n", run, nfree, run->nfree);
+          number++;
+        }
+      }
+    }
+  #endif
+  return number;
+}
+
+// returns the number of free blocks with inconsistant headers and footers
+// plus the number of blocks (epilogue included) with a wrong PREV_ALLOC bit
+static int inconsistant_footer(void) {
   void *bp;
   int number = 0;
-  for (bp = &(heap->head[1]); GET_SIZE(bp)>0; bp = NEXT_BLKP(bp)) {
-    if (HEADER(bp) != FOOTER(bp)) {
+  int previous_alloc = 1;
+  for (bp = &(heap->head[1]); ; bp = NEXT_BLKP(bp)) {
+    if (!IS_PREV_ALLOC(bp) != !previous_alloc) {
+      fprintf(stderr, "!! block %p (size=%lx) has the wrong prev alloc bit\n", bp, GET_SIZE(bp));
+      number++;
+    }
+    if (GET_SIZE(bp) == 0) break;
+    previous_alloc = IS_ALLOC(bp);
+    if (!previous_alloc && PACK_SIZE(HEADER(bp)) != PACK_SIZE(FOOTER(bp))) {
       number++;
     }
   }
   return number;
 }
 
-int first_n_bits_the_same(size_t a, size_t b, size_t n);
-int test_free_and_unvisitted(struct freenode_t *n);
-int recursive_trie_node_test(struct freenode_t *n, size_t psize, size_t bit);
+static int test_free_and_unvisitted(struct freenode_t *n);
+static int unvisit(void);
+#if !TLSF
+static int first_n_bits_the_same(size_t a, size_t b, size_t n);
+static int recursive_trie_node_test(link_t l, size_t psize, size_t bit);
 
-int first_n_bits_the_same(size_t a, size_t b, size_t n) {
+static int first_n_bits_the_same(size_t a, size_t b, size_t n) {
   if (n == 0) return TRUE;
   if (n >= BITNESS) return (a == b);
   n = BITNESS - n;
@@ -734,26 +3478,61 @@ int first_n_bits_the_same(size_t a, size_t b, size_t n) {
   n = ~n;     // 111...1000..
   return ((n & a) == (n & b));
 }
+#endif
 
 #define assert_true(t, errormessage, args...) ((!(t)) ? fprintf(stderr, errormessage , ## args), (1) : (0))
 
+#if TLSF
+// the TLSF version of triecrawl: every block in every list is free, in the
+// right list and linked both ways, and the bitmaps match the lists
+static int listcrawl(void) {
+  struct tlsf_t *t = heap->tlsf;
+  size_t fl, sl, f, l;
+  int ret = 0;
+  for (fl = 0; fl < FL_COUNT; fl++) {
+    ret += assert_true((t->sl_map[fl] != 0) == ((t->fl_map >> fl) & 1), "!! first level %lu doesn't match the first level map (%lx)!\n", fl, t->fl_map);
+    for (sl = 0; sl < SL_COUNT; sl++) {
+      link_t link = t->lists[fl][sl];
+      ret += assert_true((link != NIL) == ((t->sl_map[fl] >> sl) & 1), "!! list %lu, %lu doesn't match its map (%x)!\n", fl, sl, t->sl_map[fl]);
+      for (; link != NIL; link = NODE(link)->next) {
+        struct freenode_t *n = NODE(link);
+        tlsf_mapping(GET_SIZE(n), &f, &l);
+        ret += assert_true(f == fl && l == sl, "!! node at %p (size=%lx) is in list %lu, %lu!\n", n, GET_SIZE(n), fl, sl);
+        #if ADDRESS_ORDER
+          ret += assert_true(n->next == NIL || NODE(n->next) > n, "!! node at %p (size=%lx) is ahead of a lower address in its list!\n", n, GET_SIZE(n));
+        #endif
+        ret += test_free_and_unvisitted(n);
+      }
+    }
+  }
+  return ret + unvisit();
+}
+#else
 // this is out primary testing function
 // it crawls the entire freelist tree checking for consistancy
 // see the long comments at the end for full documentation
-int triecrawl(void) {
+static int triecrawl(void) {
   int bin_number;
   int ret = 0;
   size_t largest_size_for_bin  =  MAX_SIZE;
   // trie crawl to visit all
   for (bin_number = 0; bin_number < BIT_COUNT; bin_number++) {
-    struct freenode_t *bin = heap->bins[bin_number];
+    link_t bin = heap->bins[bin_number];
+    ret += assert_true((bin != NIL) == ((heap->binmap >> bin_number) & 1), "!! bin %d doesn't match the bin map (%lx)!\n", bin_number, heap->binmap);
     #if DEBUG>1
       fprintf(stderr, "Bin %d (size=%lx)\n", bin_number, largest_size_for_bin);
     #endif
     ret += recursive_trie_node_test(bin, largest_size_for_bin, bin_number + 1 + BIT_OFFSET);
     largest_size_for_bin  >>= 1; 
   }
-  // normal crawl to undo visits
+  return ret + unvisit();
+}
+#endif
+
+// normal crawl to undo the visits of a freelist crawl, complaining about any
+// free block that wasn't visited
+static int unvisit(void) {
+  int ret = 0;
   void *bp;
   for (bp = &(heap->head[1]); GET_SIZE(bp)>0; bp = NEXT_BLKP(bp)) {
     if (!IS_ALLOC(bp)) {
@@ -762,7 +3541,7 @@ int triecrawl(void) {
         FOOTER(bp) = PACK(GET_SIZE(bp), 0);
       } else {
         // wasn't visitted!
-        fprintf(stderr, "!! node at %p (size=%lx) is not in the trie!\n", bp, GET_SIZE(bp));
+        fprintf(stderr, "!! node at %p (size=%lx) is not in the freelist!\n", bp, GET_SIZE(bp));
         ret++;
       }
     }
@@ -770,16 +3549,21 @@ int triecrawl(void) {
   return ret;
 }
 
-int recursive_trie_node_test(struct freenode_t *n, size_t psize, size_t bit) {
+#if !TLSF
+static int recursive_trie_node_test(link_t l, size_t psize, size_t bit) {
+  if (l == NIL) return 0;
+  struct freenode_t *n = NODE(l);
   #if DEBUG>1
     fprintf(stderr, "node %p\n", n);
   #endif
-  if (n == NULL) return 0;
   #if DEBUG>1
     fprintf(stderr, " (size=%lx)\n", GET_SIZE(n));
   #endif
   int ret = assert_true(first_n_bits_the_same(psize, GET_SIZE(n), bit), "!! node at %p (size=%lx) has the wrong size for its spot in the trie!\n", n, GET_SIZE(n));
   ret += test_free_and_unvisitted(n);
+  #if ADDRESS_ORDER
+    ret += assert_true(n->next == NIL || NODE(n->next) > n, "!! node at %p (size=%lx) is ahead of a lower address in its stack!\n", n, GET_SIZE(n));
+  #endif
   #if DEBUG>1
     fprintf(stderr, "next: \n");
   #endif
@@ -797,12 +3581,13 @@ int recursive_trie_node_test(struct freenode_t *n, size_t psize, size_t bit) {
   ret += recursive_trie_node_test(n->children[1], ob, bit);
   return ret;
 }
+#endif
 
-int test_free_and_unvisitted(struct freenode_t *n) {
+static int test_free_and_unvisitted(struct freenode_t *n) {
   int ret = 0;
   ret += assert_true(!IS_ALLOC(n), "!! freenode %p (size=%lx) is not free!\n", n, GET_SIZE(n));
   ret += assert_true(!PACK_IS_ALLOC(FOOTER(n)), "!! freenode %p (size=%lx) is in the trie multiple times!\n", n, GET_SIZE(n));
-  ret += assert_true((*(n->prev) == n), "!! freenode %p (size=%lx) has a bad prev pointer!\n", n, GET_SIZE(n));
+  ret += assert_true((*SLOT(n->prev) == LINK(n)), "!! freenode %p (size=%lx) has a bad prev pointer!\n", n, GET_SIZE(n));
   FOOTER(n) = PACK(GET_SIZE(n), 1);
   return ret;
 }
@@ -825,10 +3610,27 @@ I hope you find this interesting.
 max alloc size is 268,435,448 Bytes (256 MB or 0b1111111111111111111111111000 or 4 0's, 25 1's and 3 0's)
 because 256MB and larger are best done using mmap
 
-every block (whether free or allocated) has a 1 WSIZE (from here on WSIZE is defined as sizeof(size_t)) header and footer:
+and so they are: any request of MMAP_THRESHOLD bytes or more (and anything over
+the max) never touches the heap. It gets an anonymous mapping of its own:
+[offset word][header][payload ...] where the header is the mapping length
+BITWISEOR MMAPPED (4) BITWISEOR isAllocated, and the offset word is how far into
+the mapping the payload starts. Free unmaps it, realloc mremaps it (and moves a
+heap block that grows past the threshold into a mapping). Since the bit only
+ever appears on allocated blocks, free can't confuse a mapped block for a heap
+one.
+
+every block (whether free or allocated) has a 1 WSIZE (from here on WSIZE is defined as sizeof(size_t)) header, free blocks also have a 1 WSIZE footer:
 isAllocated = 0 or 1
+prevAllocated = 0 or 2 (is the block before this one allocated)
 size = 8 byte aligned byte-size of the block (not including the header / footer)
-header/footer = size BITWISEOR isAllocated
+header = size BITWISEOR isAllocated BITWISEOR prevAllocated
+footer = size (free blocks only)
+purged = 0 or 4 on free blocks (its interior pages have been released, see below)
+
+Allocated blocks don't need a footer because the footer is only ever read by
+coalesce when the block after it is freed, and then only if its prevAllocated
+bit says the block is free. So an allocated block's payload runs on into where
+its footer would be: a block of size s holds s + WSIZE bytes.
 
 in addition, free blocks contain (inside their data segment):
 node* next  // a pointer to the next node in the stack of the same size
@@ -839,6 +3641,14 @@ NOTE: left and right are stored in an array in order to make access easier witho
 
 because freenodes must contain this info, the min alloc size is 4*sizeof(void*)
 
+unless COMPACT_NODES is set: then the four links are 32 bit byte offsets from
+heap instead of pointers (0 is NULL since heap itself is never a node, and the
+prev link is the offset of whatever link points here). That takes MIN_SIZE from
+32 to 16 bytes on 64 bit machines, at the cost of an add on every link we follow
+and the heap (each arena) having to fit in 4GB. On the default traces it came
+out even: 94% average util either way and the same throughput within noise, so
+it is off by default.
+
 NOTE: The total space this takes up is size + DSIZE  where DSIZE is 2*WSIZE
 
 We create 24 bins of sizes by the number of zeros before the first 1 in the size 
@@ -851,6 +3661,7 @@ We divide the heap space as such: (key: *=pointer, not a size; in increasing add
 unused padding bytes for alignment +
 * "heap" pointer *
 24 WORDs for the size buckets
+(with SLAB) 1 WORD per slab class, the runs with free slots
 1 WORD set to "1"
 *official heap start pointer*
 1 WORD set to "1" - prologue
@@ -861,6 +3672,166 @@ usused padding bytes - "the wilderness" <- in this implementation this is size 0
 
 + NOTE: in a production malloc we would use this padding to ensure that all valid pointers are 8 byte aligned and discard all free calls with non-aligned pointers. Perhaps in the future we'll add this level of robustness.
 
+The heap used to grow by exactly what the malloc that missed needed, which is
+the best it can do for utilization. It's also one mem_sbrk per miss, and with a
+real sbrk that's one syscall per miss. With
+HEAP_CHUNKS extend_heap adds an extra chunk that's left as the free last block.
+The chunk adapts to how often we miss: two misses less than CHUNK_WINDOW heap
+mallocs apart double it (from CHUNK_MIN), a miss after a quieter spell halves
+it and so does a trim. It's capped at a page and at 1/CHUNK_FRACTION of the
+heap, and a heap under CHUNK_MIN*CHUNK_FRACTION bytes doesn't get one at all,
+because every byte of chunk the trace hasn't used by the time it peaks counts
+against utilization. realloc extending the last block doesn't take a chunk: a
+small malloc would land in it and pin the block realloc is growing
+(REALLOC_SLACK is the answer for that case). For the same reason a realloc
+that moves a block doesn't take one when the move grows the heap, or the next
+small malloc goes in right after the new spot and the block has to move again
+on its next grow.
+
+The heap also shrinks. When a free leaves the last block free and at least
+TRIM_THRESHOLD bytes, every whole page of it past TRIM_PAD is handed back with a
+negative mem_sbrk and the epilogue moves down. mm_trim(pad) does the same on
+demand. The last block itself is never given back entirely, because without a
+footer on allocated blocks there would be no way to find the block before it.
+
+Trimming on the free itself would give pages back that a malloc / free cycle
+at the top, or the next run of a program that frees everything, faults
+straight back in. So the top has to stay free for TRIM_DELAY ms first. The
+first free that leaves it past the threshold only notes the time, a later one
+trims if it's been long enough, and anything that allocates from the top,
+grows the heap or trims starts the wait over. TRIM_PAD is the threshold
+itself, so a trim leaves enough behind that the next malloc at the top doesn't
+grow the heap straight back. TRIM_DELAY=0 trims on the free.
+
+Free blocks in the middle of the heap can't be trimmed, but the pages inside
+them can still be given back. With PURGE on, a free block of PURGE_THRESHOLD
+bytes or more gets madvise(MADV_DONTNEED) on every whole page between its
+freenode fields and its footer, and then the PURGED bit (4, the same bit as
+MMAPPED, which only allocated blocks use) in its header. The bit survives the
+block being split by place or trimmed, so we don't redo the syscall on memory
+that's already gone. Any merge clears it (the seams between the pieces are
+still resident) and the next free purges the whole block again. That keeps the
+bit exact: every whole page between a purged block's freenode fields and its
+footer reads as zero.
+
+PURGE is off by default. It's for long running programs that care about
+RSS, and every trace pays for it: a freed block comes back as fresh pages,
+and the next malloc that lands there faults them all in again. That cost
+about a third of the driver's throughput on top of the trimming, even with
+PURGE_THRESHOLD at 256KB. MADV_FREE (lazy, so pages used again before the
+kernel wants them cost nothing) would be cheaper, but it would break the
+zero-page guarantee calloc relies on.
+
+mm_calloc leans on that. Memory the heap has never had before also comes back
+zero from sbrk, so calloc_block only memsets the parts of a block that aren't
+known to be zero: a block carved from a purged block skips its released
+pages, and a block made by extend_heap / extend_block skips everything past
+the highest brk the heap has ever had (memlib's mem_fresh_lo, or the arena's
+fresh mark). The word where the block's footer would go is always cleared,
+because extend_heap writes a footer there. Blocks reused from the trie and
+slab slots are zeroed in full, and mapped blocks not at all. In the thread
+safe build anything small enough for the thread cache is zeroed in full too.
+
+mm_memalign / mm_posix_memalign go through aligned_block (which the slabs use
+for their runs too). The payload has to start on the boundary and anything in
+front of it has to be a free block of its own, so a block of asize + align +
+MIN_SIZE + DSIZE always works. Asking for that every time wastes most of it,
+so freelist_alignedfit first walks up the sizes from asize (and the stacks of
+blocks of each size) for one whose address happens to line up, and only
+settles for the sure size after ALIGNED_FIT_TRIES blocks. The misaligned
+front goes back to the trie as a free block and place splits off the tail as
+usual. Alignments over a page, and sizes at the mmap threshold, get a mapping
+of align extra bytes instead, which gives back the whole pages it didn't use
+on either side. The offset word then says how far in the payload starts.
+
+mm_malloc_batch / mm_free_batch take arrays and do the per call work once:
+one lock (per arena, for frees), and one mm_check in DEBUG builds. In the
+thread safe build whatever the thread cache can take or give is done first
+without the lock, just like the single calls. A run of mallocs of the same
+block size that finds an exact fit takes the rest of the run off that size's
+stack instead of searching the trie again. A free batch is sorted by address
+first (insertion sort, since blocks malloced together are mostly in order
+already). Blocks that turn out to be back to back become one free block
+before coalesce sees them, so the run costs one merge instead of a trie
+insert and remove per block. "mdriver -b" times every trace a second time
+with its runs of mallocs and frees batched. Single threaded, it comes out
+about even: 10-25% faster on the traces with long runs, slower on the
+realloc traces where every run is one op long.
+
+mm_free_sized(bp, size) is mm_free for callers who still know what they asked
+for. The size picks the path (slab, thread cache class, trie or munmap) without
+reading the header first, so the header and the next block's header are only
+prefetched and the loads overlap with taking the lock. The size has to be the
+one given to mm_malloc / mm_calloc / mm_realloc (mm_memalign blocks go to
+plain mm_free). DEBUG builds check it against the header and print a warning
+when it doesn't fit the block.
+
+realloc tries to keep a growing block where it is: it takes the free block
+after it, or extends the heap if it is the last block. Failing that, if the
+block in front of it is free and that block plus this one (plus the next one,
+when that is free too) is big enough, it merges them and memmoves the payload
+down to the start. It's the same copy dumb_realloc would do, but it doesn't
+search the trie and it doesn't leave a hole where the old block was. The
+driver's realloc traces always grow the last block, so they never get here.
+traces/reallocdown-bal.rep does. It frees the block in front of one and then
+grows it, once with the next block allocated and once with a free next block
+too small to take the growth on its own. 541 of its 1200 reallocs slide down
+(mdriver -v with STATS=1).
+
+When a block of at least REMAP_THRESHOLD bytes does have to move, it doesn't
+get copied. remap_realloc asks aligned_block for a new block whose payload
+starts at the same offset into its page as the old one (that's what the skew
+argument is for). Then only the partial pages at either end are memcpy'd, and
+memlib's mem_remap has the kernel move the whole pages in between (memlib maps
+its heap with mmap so that the pages can move). The old block is left with
+zero pages, which go to the trie when the block is freed.
+
+A remap isn't free either: it's three syscalls (mmap the pages that refill
+the old spot, then two mremaps), and those fresh pages fault again when the
+old spot is reused. memcpy is cheaper than that for anything under a couple
+of MB, which is why REMAP_THRESHOLD is 2MB. Only blocks at MMAP_THRESHOLD and
+up, which mremap moves as a whole mapping, cost about the same to move
+whatever their size. A heap block that grows past the threshold is copied
+into its new mapping once. traces/bigrealloc-bal.rep and
+traces/reallocsweep-bal.rep (not in the default set) grow buffers with blocks
+malloced behind them so that most grows are moves. They stop short of 4MB
+because the driver won't take a payload outside memlib's heap.
+
+With QUICK_LISTS on, free puts heap blocks of up to QUICK_MAX_SIZE bytes onto
+a stack per block size (linked through the first word, like the thread
+cache) instead of coalescing them. They keep their allocated bit, so as far
+as the rest of the heap knows they are still in use. malloc checks the stack
+for its exact block size before the trie, so a free followed by a malloc of
+the same size skips the trie insert, the remove, the merge and the split.
+Once QUICK_COUNT blocks have piled up, or when a malloc finds nothing in the
+trie (before it would grow the heap), every one of them is freed for real
+and coalesced. mm_trim does the same first. Batched frees skip the quick
+lists, since they merge their runs anyway. It's off by default because the
+slabs and the exact-fit stacks already catch most of this churn. Replaying
+the traces in a loop with the default build, binary-bal and binary2-bal get
+3-5% faster, random-bal 8%, and cccp-bal 8% slower. With SLAB=0, where small
+blocks go through the trie, binary2-bal gets 2.7x faster and binary-bal
+1.4x. coalescing-bal doesn't change: its 4KB and 8KB blocks are well over
+QUICK_MAX_SIZE. Raising QUICK_MAX_SIZE enough to catch them made it much
+slower, because every 8KB malloc misses and flushes the lists.
+
+With REALLOC_SLACK on, realloc also watches for blocks that keep growing. Each
+heap has a small table (GROW_SLOTS entries, hashed by address, kept outside the
+heap like the slab map) of blocks realloc has grown lately. From the
+GROW_STREAK-th grow in a row, the block gets half as much again as it asked
+for, whichever way it grows. The grows after that land in the slack without
+touching the heap at all. Shrinking the block or freeing it drops it from the
+table, and shrinking cuts the slack off as usual. Each entry also keeps the
+block size it left the block with. A block whose header says something else has
+been resized some other way, or freed and handed out again without going
+through the table, so its entry is dropped instead of trusted. When the heap
+can't grow any more, malloc cuts every tracked block back to what its caller
+asked for and looks again before giving up. Blocks small enough for the thread
+cache are never tracked, because a cached block must not change size under it.
+It's off by default because the driver pays for it: the realloc traces run
+about twice as fast, but their utilization drops from 100% / 70% to 77% / 55%,
+which takes the total from 94% to 90% and the index from 96 to 94.
+
 /////////////////
 // Free List data structure
 ////////////////
@@ -868,6 +3839,11 @@ usused padding bytes - "the wilderness" <- in this implementation this is size 0
 
 Each bin contains a root pointer to a bitwise trie for blocks in that size range, and each node in the bitwise trie points to a stack of blocks of the same size.
 
+The heap header also keeps binmap, a word with bit n set whenever bin n is not
+empty. When a search misses in its own bin, the next larger non-empty bin is
+found by masking off our bin and everything after it and taking the highest
+bit that is left (one clz), rather than looping over the bins.
+
 Below is a discussion of how a bitwise trie generally works.
 --------
 Bitwise Trie
@@ -973,5 +3949,201 @@ We do this by making each node in the bitwise trie the head of a stack, where al
 
 consistant use of the "prev" pointer pointer makes both the trie and the stack doubly linked, which allows efficient and somewhat agnostic node insertion and removal.
 
+With ADDRESS_ORDER=1 the stack isn't last in first out any more: it's kept
+sorted by address, so bestfit (which always takes the top) reuses the lowest
+block of a size and the ones near the top of the heap stay free to be trimmed.
+A block below the top goes on top like before (it takes over the trie links).
+Anything else walks down the stack to its spot and never touches the trie. The
+same goes for the TLSF lists. It leaves smaller heaps behind for about the
+same utilization, but that walk is long on traces that free thousands of
+blocks of one size, so it stays off by default.
+
+/////////////////
+// TLSF
+////////////////
+
+How long the trie takes depends on what's in it. freelist_bestfit follows one
+child per bit of the size (up to ~25 levels) and then smallest_ancestor walks
+another path. Building with TLSF=1 swaps the trie for two level segregated fit
+lists, which take a bounded number of steps whatever the heap looks like. The
+block layout and boundary tags don't change. A free node just leaves children
+unused: next and prev make each list a stack like the trie's same size stacks.
+
+First level 0 is the sizes below 2^TLSF_SL_BITS * ALIGNMENT (128 bytes), one
+list per ALIGNMENT. After that, first level fl is a power of two, cut into
+2^TLSF_SL_BITS lists of equal width. fl_map says which first levels have any
+blocks and sl_map[fl] which of their lists do, so freelist_add and
+freelist_remove are a clz and a couple of shifts. freelist_bestfit rounds the
+size up to the start of the next list, masks the maps and takes the first block
+from the first list it finds. Every block in that list holds the size without
+looking at it (that's the "good fit" part).
+
+The textbook version does only that, and a 1000 byte request skips every
+1000-1023 byte block, which costs utilization against the trie's exact best
+fit. So before rounding up, bestfit peeks at the block on top of the
+request's own list and takes it if it's big enough. That's still O(1).
+
+The lists are 22*16 links, far more than the trie's 24 bins. They live outside
+the heap like the slab map so they don't count against utilization. That only
+changes with COMPACT_NODES, because its 32 bit links can't reach outside the
+heap. What TLSF buys is a shorter tail (mdriver -L shows it): the trie's
+worst ops are the deep walks on the random traces. Throughput is about the
+same, so it stays off by default and the layout that everything else in this
+file was tuned against doesn't change.
+
+Every mdriver build has both engines. The Makefile compiles mm.c a second
+time as mm-alt.o with MM_BACKEND defined, like the implicit and naive
+packages. That copy flips TLSF (so it's TLSF in a default build, and the trie
+with MMFLAGS=-DTLSF=1) and renames its public calls to alt_. Everything else
+in it is static, so the copies share nothing but memlib. mdriver -m trie -m
+tlsf runs them side by side on the same traces with the same flags. The
+engine isn't a per-heap switch (a table of freelist calls): that would put
+an indirect call on every freelist operation of the trie build too.
+
+/////////////////
+// Slabs
+////////////////
+
+Small requests (up to SLAB_MAX_SIZE) never see the trie. They are rounded up to
+one of the slab_sizes classes and get a slot in a run: a SLAB_RUN_SIZE aligned
+chunk of the heap that is carved into equal slots. A slot has no header or
+footer, so a 16 byte request really costs 16 bytes (plus its share of the run).
+
+A run is just an ordinary allocated block to the rest of the heap. Its block is
+exactly SLAB_RUN_SIZE long including the header / footer, so runs made at the
+end of the heap sit back to back. It begins with a struct slab_run_t that has
+a bitmap of its free slots; runs with free slots are kept on a doubly linked
+list per class in the heap header.
+
+Since slots have no header, free has to be told that a pointer is a slot
+some other way: slab_map has one bit per SLAB_RUN_SIZE of the heap, set where
+a run starts. A run that becomes empty goes back to the trie, unless it's the
+last run of its class (so a malloc / free pair doesn't make and break a run).
+
+/////////////////
+// Arenas and thread caches
+////////////////
+
+With THREAD_SAFE set there are ARENA_COUNT arenas. Each one is a whole heap of
+its own (heaphead_t, trie, slabs, last_block) guarded by its own lock. "heap" is
+then a thread local that points at the arena the thread has locked, so nothing
+below the public calls knows arenas exist. Arena 0 is memlib's heap. The rest
+live in one big MAP_NORESERVE mapping, ARENA_SPAN bytes each: the slab map sits
+at the bottom of a slice and its heap grows up from there through heap_sbrk.
+Since the slices are contiguous, free finds a block's arena with one subtract
+and one divide. Anything outside the region (arena 0 and mapped blocks) goes to
+arena 0.
+
+A thread mallocs from the arena of the cpu it first ran on (sched_getcpu), or
+round robin if that fails. When it finds its arena locked, it moves on to the
+next one in the round robin. The thread that calls mm_init always stays in
+arena 0, which keeps the driver's single threaded runs inside memlib's heap.
+mm_init throws every arena away; arenas past 0 get a fresh heap the next time
+someone locks them.
+
+A free from a thread that doesn't malloc from the block's arena doesn't take
+that arena's lock either. The block is pushed onto the arena's remote list (a
+stack linked through the first payload word, pushed with one CAS). Whoever
+locks the arena next swaps the whole list out and frees it into the trie before
+doing anything else. The owner's next malloc does that before it ever looks at
+the trie. Producer / consumer pipelines then only ever lock their own arena.
+Mapped blocks skip the list and get unmapped right away.
+
+Taking a lock on every call still costs, so each thread also keeps a cache of
+blocks of up to TCACHE_MAX_SIZE bytes.
+
+The cache has one stack per block size (size/ALIGNMENT is the index), linked
+through the first word of each block. Cached blocks keep their allocated bit so
+as far as the heap is concerned they are still in use and nothing coalesces
+into them.
+
+mm_free pushes small blocks onto the cache without locking. Once a stack holds
+TCACHE_COUNT blocks, half of them are spilled back to the trie under one lock.
+mm_malloc pops from the cache. On a miss it takes the lock, mallocs as normal
+and also pulls a few more blocks of exactly that size out of the trie (if there
+are any) so the next few mallocs don't need the lock.
+
+mm_init bumps a generation counter, which throws away any cache that belongs
+to an old heap. When a thread exits its cache is handed back to the trie.
+Cached blocks can come from any arena. So spills and flushes look up each
+block's arena and only switch locks when the arena changes.
+
+/////////////////
+// Stats
+////////////////
+
+mm_stats fills in a struct mm_stats (see mm.h), our version of mallinfo. The
+part that describes the heap is worked out when it's called: it walks the trie
+(or the TLSF lists) of every arena under that arena's lock, adding up the free
+blocks by power of two and counting the trie nodes. That costs nothing until
+somebody asks.
+
+The counts (live bytes, sbrks, splits in place, the four coalesce cases and
+how each realloc was done) are kept as it goes, so they're only there when
+built with STATS=1. With it off the STAT macros are empty and the code is the
+same as before and mm_stats reports them as 0, next to heap numbers that are
+still right. In
+the thread safe build each thread gets one of STATS_SHARDS cache line aligned
+shards and adds to it with relaxed atomic adds. They only need to be atomic
+because threads past STATS_SHARDS share shards. mm_stats adds the shards up.
+live_bytes goes up and down on different threads, but the sum works out
+because a size_t wraps.
+
+live_bytes is counted at the public calls with usable_size, so blocks in a
+thread cache or quick list count as freed there even though the heap still
+sees them as allocated. That costs a header read in mm_free_sized, which
+otherwise manages without one. Single threaded replays with STATS=1 were within
+noise of the plain build. A threaded calloc / memalign / realloc stress test
+ran about 10% slower (23ms vs 21ms), mostly from the atomics.
+
+/////////////////
+// Profiler
+////////////////
+
+Built with PROFILE=1, mm_profile(rate) turns on a sampling heap profiler like
+tcmalloc's. Each thread counts down a random gap (exponential, with mean rate
+bytes) by the size of every malloc. The malloc that takes it below zero gets
+its call stack saved with backtrace() in a little hash table keyed on the
+block, and free takes it back out. mm_profile_dump(fd) groups the samples that
+are still live by stack and prints them biggest first, with the bytes each
+stack probably holds. A sample of n bytes stands for n / (1 - e^(-n/rate))
+bytes, so a big block counts for about itself and a small one for about rate.
+
+Only the sampled mallocs (and frees of blocks sharing a hash bucket with a
+sample) take the profiler's lock. Everything else pays a subtraction, or a
+load that's almost always NULL. realloc keeps a block's sample if it had one,
+otherwise it only counts what the block grew by, or a block growing a bit at
+a time would get sampled again on nearly every realloc.
+
+Having the profiler built in but off costs next to nothing. Sampling costs
+about what backtrace() does, so the rate sets the price: traces that malloc
+the most bytes per op get sampled the most.
+
+mdriver -P <rate> calls mm_profile(rate) before a package's traces, so the
+timed runs get sampled too. It writes each trace's profile to
+<trace>-<package>.prof at the op where the most bytes are live (by the end
+they've all been freed).
+
+/////////////////
+// Layout dumps
+////////////////
+
+mm_dump_layout(fd) walks every heap from head[1] with NEXT_BLKP, like the
+DEBUG walkers do, and writes a CSV row per block (see mm.h for the columns).
+It takes each arena's lock while it walks that arena, so it works in the
+thread safe build too. Blocks in a thread cache or quick list show up as
+allocated, and a slab run shows up as one allocated block with its slot size
+and how many slots are in use. It doesn't change anything, so it's there in
+every build. mdriver -D <n> calls it every n ops of the util run, and the
+files sort by op number so they can be flipped through as an animation.
+
+Here's binary-bal that way (-D 1000). During the first 4000 ops the heap is
+just the 448s end to end, with the 64s packed into slab runs between them
+and 33 small free blocks (12KB in all). After the 448s are freed (op 6000)
+924KB is free, but in only 34 blocks: the slab runs split it up, so the
+biggest free block is 28KB. That's plenty for the 512s that come next, so
+the heap only grows from 1061KB to 1179KB to hold them. coalescing-bal is
+dull to watch: it never has more than two blocks.
+
 
 *********************************/
@@ -3,7 +3,90 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+/* mm_free for callers that know the size they malloced / calloced /
+   realloced ptr with (not for mm_memalign blocks) */
+extern void mm_free_sized(void *ptr, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
+/* malloc of nmemb*size zeroed bytes (NULL if that overflows) */
+extern void *mm_calloc(size_t nmemb, size_t size);
+/* malloc whose result is a multiple of align (a power of two), NULL if
+   align isn't one */
+extern void *mm_memalign(size_t align, size_t size);
+/* the POSIX flavor: align must also be a multiple of sizeof(void *).
+   returns 0, EINVAL or ENOMEM and leaves the block in *memptr */
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+/* mallocs n blocks (sizes[i] bytes into ptrs[i]) in one go. returns how
+   many were allocated, the rest are NULL */
+extern size_t mm_malloc_batch(size_t n, const size_t *sizes, void **ptrs);
+/* frees the n blocks in ptrs in one go (ptrs gets sorted by address) */
+extern void mm_free_batch(size_t n, void **ptrs);
+/* gives free memory at the top of the heap back, keeping pad bytes.
+   returns 1 if the heap shrank */
+extern int mm_trim(size_t pad);
+
+/* 
+ * What mm_stats reports (our mallinfo). The counts only count in an mm.c
+ * built with STATS=1 and are all 0 otherwise. The rest is looked up on the
+ * spot: blocks sitting in a thread cache or quick list count as allocated.
+ */
+#define MM_STATS_BINS 32
+struct mm_counts {
+    size_t live_bytes;       /* usable bytes handed out and not freed yet */
+    size_t sbrks;            /* times a heap grew or shrank */
+    size_t splits;           /* blocks that had a free remainder split off */
+    size_t coalesce[4];      /* frees that merged with nothing, the next block,
+                                the previous block, both */
+    size_t realloc_in_place; /* reallocs the block already had room for */
+    size_t realloc_next;     /* ... that grew into the free block after it */
+    size_t realloc_extend;   /* ... that grew the heap under the last block */
+    size_t realloc_down;     /* ... that slid down into the block before it */
+    size_t realloc_move;     /* ... that had to move the block */
+};
+struct mm_stats {
+    struct mm_counts counts;
+    size_t heap_bytes;       /* how big the heaps are */
+    size_t free_blocks;      /* free blocks in them */
+    size_t free_bytes[MM_STATS_BINS]; /* free bytes in blocks of 2^n bytes
+                                         up to 2^(n+1) */
+    size_t free_nodes;       /* trie nodes (one per free size), or the
+                                non-empty TLSF lists */
+};
+extern void mm_stats(struct mm_stats *stats);
+
+/* heap profiling (in an mm.c built with PROFILE=1): from now on record the
+   call stack of about one malloced block per rate bytes (0 stops) */
+extern void mm_profile(size_t rate);
+/* writes the sampled blocks that are still live to fd, by call stack */
+extern void mm_profile_dump(int fd);
+
+/* writes a CSV map of every block in the heap(s) to fd, one row per block
+   in address order under the header line
+     arena,offset,size,alloc,bin,slot_size,slots_used
+   offset is from the start of that arena's heap and size is the block size.
+   bin is the free list a free block is on (-1 for allocated ones).
+   slot_size and slots_used say what a slab run holds (0 for other blocks).
+   Mapped blocks aren't in any heap and aren't listed */
+extern void mm_dump_layout(int fd);
+
+/* 
+ * One malloc package mdriver can run (-m picks them by name). Each
+ * package file defines one of these for itself. Calls a package doesn't
+ * have are NULL and mdriver builds them out of the ones it does have.
+ */
+typedef struct {
+    const char *name;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    size_t (*malloc_batch)(size_t n, const size_t *sizes, void **ptrs);
+    void (*free_batch)(size_t n, void **ptrs);
+    void (*stats)(struct mm_stats *stats);
+    void (*dump_layout)(int fd);
+    void (*profile)(size_t rate);
+    void (*profile_dump)(int fd);
+} mm_backend_t;
 
 
 /* 